@@ -12,6 +12,17 @@ LIBS += -lpthread
 QMAKE_CFLAGS += -O3 -mfpu=neon # -march=armv7-a
 QMAKE_CXXFLAGS += -O3 -mfpu=neon # -march=armv7-a
 
+# Single format build for a board with a known panel, see Makefile
+# ex: qmake FBO_FIXED_LAYOUT=XRGB8888 "FBO_FORMATS=P6 BMPC"
+!isEmpty(FBO_FIXED_BPP): DEFINES += FBO_FIXED_BPP=$$FBO_FIXED_BPP
+!isEmpty(FBO_FIXED_LAYOUT): DEFINES += FBO_FIXED_LAYOUT=$$FBO_FIXED_LAYOUT FBO_FIXED_LAYOUT_$$FBO_FIXED_LAYOUT
+!isEmpty(FBO_FORMATS) {
+    DEFINES += FBO_FORMATS
+    for(format, FBO_FORMATS): DEFINES += FBO_FORMAT_$$format
+    QMAKE_CFLAGS += -ffunction-sections -fdata-sections
+    QMAKE_LFLAGS += -Wl,--gc-sections
+}
+
 TARGET = fbo
 #target.path = # path on device
 INSTALLS += target
@@ -0,0 +1,180 @@
+#!/bin/bash
+
+# Conformance run of every output path over the virtual device layouts.
+# Every capture is compared against the checksums in fboconform.md5, the capture latency line is printed per path.
+# The BMP pixels are also checked against the netpbm images of the same device (BMPG = P5, BMPC = P6 in BGR order,
+# both = P4 bits on mono devices), so a broken kernel can't be saved as golden output.
+
+# Function to display help
+show_help() {
+    echo "Usage: $0 [OPTIONS]
+
+Options:
+  -h, --help           Show this help message and exit
+  -b, --binary FBO     fbo binary to test (default: ./fbo)
+  -s, --sums FILE      Golden checksums (default: fboconform.md5 next to this script)
+  -k, --keep DIR       Keep the captured images in DIR
+  -u, --update         Rewrite the golden checksums from this run
+"
+}
+
+# Default values
+FBO="./fbo"
+SUMS="$(dirname "$0")/fboconform.md5"
+KEEP=""
+UPDATE=0
+WIDTH=96 # multiple of 8, so neither BMP nor P4 rows are padded
+HEIGHT=64
+
+# Parse command line arguments
+while [[ $# -gt 0 ]]; do
+    case $1 in
+        -h|--help)
+            show_help
+            exit 0
+            ;;
+        -b|--binary)
+            FBO="$2"
+            shift 2
+            ;;
+        -s|--sums)
+            SUMS="$2"
+            shift 2
+            ;;
+        -k|--keep)
+            KEEP="$2"
+            shift 2
+            ;;
+        -u|--update)
+            UPDATE=1
+            shift
+            ;;
+        *)
+            echo "Unknown option: $1"
+            show_help
+            exit 1
+            ;;
+    esac
+done
+
+FORMATS="XRGB8888 ARGB8888 XBGR8888 ABGR8888 RGB888 BGR888 RGB565 BGR565 XRGB1555 XRGB8888:visual=direct C8 MONO01 MONO10"
+# path name and fbo options, P4 of a color device goes through the scaled path
+COLOR_PATHS="P4:-o@%s:format=pbm P5:-g P6:-c BMPG:-b@-g BMPC:-b@-c BMPP:-b@-P@332 GIF:-G"
+MONO_PATHS="P4: BMPG:-b@-g BMPC:-b@-c"
+
+# line bytes of the visible width, the padded stride adds a few bytes that are no multiple of a pixel
+line_bytes() {
+    case $1 in
+        MONO*) echo $(( (WIDTH + 7) / 8 )) ;;
+        C8*) echo "$WIDTH" ;;
+        RGB888*|BGR888*) echo $(( WIDTH * 3 )) ;;
+        RGB565*|BGR565*|XRGB1555*) echo $(( WIDTH * 2 )) ;;
+        *) echo $(( WIDTH * 4 )) ;;
+    esac
+}
+
+# pixel bytes of an image, one decimal value per line
+pixels() {
+    tail -c "$2" "$1" | od -An -v -tu1 | tr -s ' ' '\n' | grep -v '^$'
+}
+# P4 bits as gray bytes, 1 is black
+pbm_gray() {
+    pixels "$1" $(( WIDTH * HEIGHT / 8 )) | awk '{ for (bit = 7; bit >= 0; bit--) print (int($1 / 2 ^ bit) % 2) ? 0 : 255 }'
+}
+# BMPC pixels in P6 channel order
+bgr_to_rgb() {
+    awk 'NR % 3 == 1 { blue = $1 } NR % 3 == 2 { green = $1 } NR % 3 == 0 { print $1; print green; print blue }'
+}
+# checks the BMP images of a device against its netpbm images
+reference() {
+    local device=$1 expected actual
+    for name in BMPG BMPC; do
+        [ -s "$WORK/$name" ] || continue
+        case $name:$device in
+            BMPG:*MONO*) expected=$(pbm_gray "$WORK/P4") ;;
+            BMPC:*MONO*) expected=$(pbm_gray "$WORK/P4" | awk '{ print; print; print }') ;;
+            BMPG:*) expected=$(pixels "$WORK/P5" $(( WIDTH * HEIGHT ))) ;;
+            BMPC:*) expected=$(pixels "$WORK/P6" $(( WIDTH * HEIGHT * 3 ))) ;;
+        esac
+        if [ "$name" = BMPC ]; then
+            actual=$(pixels "$WORK/$name" $(( WIDTH * HEIGHT * 3 )) | bgr_to_rgb)
+        else
+            actual=$(pixels "$WORK/$name" $(( WIDTH * HEIGHT )))
+        fi
+        ((count++))
+        if [ -n "$expected" ] && cmp -s <(echo "$expected") <(echo "$actual"); then
+            echo "PASS $device $name: same pixels as the netpbm image"
+        else
+            echo "FAIL $device $name: pixels differ from the netpbm image"
+            ((failed++))
+        fi
+    done
+}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+[ -n "$KEEP" ] && mkdir -p "$KEEP"
+
+failed=0
+count=0
+: > "$WORK/sums"
+for format in $FORMATS; do
+    case $format in
+        MONO*) paths=$MONO_PATHS ;;
+        *) paths=$COLOR_PATHS ;;
+    esac
+    for layout in "stride=$(( $(line_bytes "$format") + 36 ))" "xoffset=8:yoffset=4"; do
+        device="virt:${WIDTH}x${HEIGHT}:$format:$layout"
+        rm -f "$WORK"/P* "$WORK"/BMP* "$WORK"/GIF
+        for path in $paths; do
+            name=${path%%:*}
+            image="$WORK/$name"
+            rm -f "$image"
+            # '@' separates the options, %s is the image when the path writes through -o
+            options=$(printf -- "${path#*:}" "$image" | tr '@' ' ')
+            if [[ "${path#*:}" == *%s* ]]; then
+                "$FBO" -d "$device" $options 2> "$WORK/log"
+            else
+                "$FBO" -d "$device" $options > "$image" 2> "$WORK/log"
+            fi
+            status=$?
+            if [ $status -eq 0 ]; then
+                sum=$(md5sum < "$image" | cut -d' ' -f1)
+            else
+                sum="exit$status"
+            fi
+            key="$device $name"
+            echo "$sum  $key" >> "$WORK/sums"
+            [ -n "$KEEP" ] && cp "$image" "$KEEP/$(echo "$key" | tr ':= ' '___').$name" 2>/dev/null
+            ((count++))
+
+            latency=$(grep "capture latency" "$WORK/log" | sed 's/^fbo: virtual device: //')
+            if [ $UPDATE -eq 1 ]; then
+                echo "SAVE $key: $latency"
+            elif grep -q -x -F "$sum  $key" "$SUMS"; then
+                echo "PASS $key: $latency"
+            else
+                echo "FAIL $key: $sum, expected $(grep -F "  $key" "$SUMS" | cut -d' ' -f1)"
+                ((failed++))
+            fi
+        done
+        reference "$device"
+    done
+done
+
+if [ $UPDATE -eq 1 ]; then
+    if [ $failed -ne 0 ]; then
+        echo "$failed reference checks failed, $SUMS is not updated"
+        exit 1
+    fi
+    cp "$WORK/sums" "$SUMS"
+    echo "$count checks passed, checksums saved to $SUMS"
+    exit 0
+fi
+# the whole list, also catches stale entries of paths that are no longer run
+if ! cmp -s "$WORK/sums" "$SUMS"; then
+    [ $failed -eq 0 ] && echo "FAIL checksum list differs from $SUMS"
+    failed=$(( failed > 0 ? failed : 1 ))
+fi
+echo "$(( count - failed ))/$count passed"
+[ $failed -eq 0 ]
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // vmsplice, F_SETPIPE_SZ
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -5,6 +6,7 @@
 #include <assert.h>
 
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
@@ -12,6 +14,10 @@
 #include <inttypes.h>
 #include <endian.h>
 #include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include <linux/fb.h>
 
@@ -19,8 +25,11 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
 #include <arm_neon.h>
+#endif
 
 #if !defined(le32toh) || !defined(le16toh)
 
@@ -35,6 +44,111 @@
 
 #endif
 
+// gcc vectorizes only loops with a known trip count at -O2, this lets the marked row loops through
+#if defined(__GNUC__) && !defined(__clang__)
+#define VECTORIZED_LOOP __attribute__((optimize("tree-vectorize", "vect-cost-model=cheap")))
+#else
+#define VECTORIZED_LOOP
+#endif
+
+// Single format build, see Makefile. The layout fixes the pixel size and the channel offsets at
+// compile time, so the row kernels lose their per pixel format switch.
+#if defined(FBO_FIXED_LAYOUT_XRGB8888) || defined(FBO_FIXED_LAYOUT_ARGB8888)
+#define FIXED_LAYOUT_BPP 32
+#define FIXED_RED_OFFSET 16
+#define FIXED_GREEN_OFFSET 8
+#define FIXED_BLUE_OFFSET 0
+#define FIXED_RED_LENGTH 8
+#define FIXED_GREEN_LENGTH 8
+#define FIXED_BLUE_LENGTH 8
+#elif defined(FBO_FIXED_LAYOUT_XBGR8888) || defined(FBO_FIXED_LAYOUT_ABGR8888)
+#define FIXED_LAYOUT_BPP 32
+#define FIXED_RED_OFFSET 0
+#define FIXED_GREEN_OFFSET 8
+#define FIXED_BLUE_OFFSET 16
+#define FIXED_RED_LENGTH 8
+#define FIXED_GREEN_LENGTH 8
+#define FIXED_BLUE_LENGTH 8
+#elif defined(FBO_FIXED_LAYOUT_RGB888)
+#define FIXED_LAYOUT_BPP 24
+#define FIXED_RED_OFFSET 16
+#define FIXED_GREEN_OFFSET 8
+#define FIXED_BLUE_OFFSET 0
+#define FIXED_RED_LENGTH 8
+#define FIXED_GREEN_LENGTH 8
+#define FIXED_BLUE_LENGTH 8
+#elif defined(FBO_FIXED_LAYOUT_BGR888)
+#define FIXED_LAYOUT_BPP 24
+#define FIXED_RED_OFFSET 0
+#define FIXED_GREEN_OFFSET 8
+#define FIXED_BLUE_OFFSET 16
+#define FIXED_RED_LENGTH 8
+#define FIXED_GREEN_LENGTH 8
+#define FIXED_BLUE_LENGTH 8
+#elif defined(FBO_FIXED_LAYOUT_RGB565)
+#define FIXED_LAYOUT_BPP 16
+#define FIXED_RED_OFFSET 11
+#define FIXED_GREEN_OFFSET 5
+#define FIXED_BLUE_OFFSET 0
+#define FIXED_RED_LENGTH 5
+#define FIXED_GREEN_LENGTH 6
+#define FIXED_BLUE_LENGTH 5
+#elif defined(FBO_FIXED_LAYOUT_BGR565)
+#define FIXED_LAYOUT_BPP 16
+#define FIXED_RED_OFFSET 0
+#define FIXED_GREEN_OFFSET 5
+#define FIXED_BLUE_OFFSET 11
+#define FIXED_RED_LENGTH 5
+#define FIXED_GREEN_LENGTH 6
+#define FIXED_BLUE_LENGTH 5
+#elif defined(FBO_FIXED_LAYOUT)
+#error "unknown FBO_FIXED_LAYOUT: XRGB8888, ARGB8888, XBGR8888, ABGR8888, RGB888, BGR888, RGB565 or BGR565"
+#endif
+#ifdef FIXED_LAYOUT_BPP
+#if defined(FBO_FIXED_BPP) && FBO_FIXED_BPP != FIXED_LAYOUT_BPP
+#error "FBO_FIXED_BPP doesn't match FBO_FIXED_LAYOUT"
+#endif
+#undef FBO_FIXED_BPP
+#define FBO_FIXED_BPP FIXED_LAYOUT_BPP
+#endif
+
+// FBO_FORMATS: only the listed output formats are built, every format without it
+#if !defined(FBO_FORMATS) || defined(FBO_FORMAT_P4)
+#define FORMAT_P4 1
+#else
+#define FORMAT_P4 0
+#endif
+#if !defined(FBO_FORMATS) || defined(FBO_FORMAT_P5)
+#define FORMAT_P5 1
+#else
+#define FORMAT_P5 0
+#endif
+#if !defined(FBO_FORMATS) || defined(FBO_FORMAT_P6)
+#define FORMAT_P6 1
+#else
+#define FORMAT_P6 0
+#endif
+#if !defined(FBO_FORMATS) || defined(FBO_FORMAT_BMPG)
+#define FORMAT_BMPG 1
+#else
+#define FORMAT_BMPG 0
+#endif
+#if !defined(FBO_FORMATS) || defined(FBO_FORMAT_BMPC) || defined(FBO_FORMAT_BMP)
+#define FORMAT_BMPC 1
+#else
+#define FORMAT_BMPC 0
+#endif
+#if !defined(FBO_FORMATS) || defined(FBO_FORMAT_BMPP)
+#define FORMAT_BMPP 1
+#else
+#define FORMAT_BMPP 0
+#endif
+#if !defined(FBO_FORMATS) || defined(FBO_FORMAT_GIF)
+#define FORMAT_GIF 1
+#else
+#define FORMAT_GIF 0
+#endif
+
 #define VERSION_MAJOR "1"
 #define VERSION_MINOR "1.0"
 #define VERSION VERSION_MAJOR "." VERSION_MINOR
@@ -55,11 +169,29 @@ INTRO "\n" \
 "-v or --version <noarg> : print the version \n" \
 "-i or --info <noarg> : prints information about framebuffer device\n" \
 "-d or --device <arg> : framebuffer device. Default: " DefaultFbDev "\n" \
-"-o or --output <arg> : output file \n" \
+"                        virt:WxH[:FORMAT][:stride=N][:xoffset=N][:yoffset=N][:visual=direct][:file] is a virtual device with synthetic or raw file contents.\n" \
+"                        FORMAT: XRGB8888 (default), ARGB8888, XBGR8888, ABGR8888, RGB888, BGR888, RGB565, BGR565, XRGB1555, C8 (palette), MONO01, MONO10\n" \
+"-o or --output <arg> : output file. Can be given more than once: file[:scale=1/N][:format=pbm|pgm|ppm|bmp|bmpc|bmpg|bmpp]. The framebuffer is read once for all outputs\n" \
 "-g or --gray <noarg> : grayscale color mode. P5, pgm file format. RGB channel order\n" \
 "-c or --colored <noarg> : full color mode. P6, ppm file format\n" \
 "-b or --colored <noarg> : bitmap file format otherwise file format is pgm or ppm\n"\
+"-G or --gif <noarg> : gif file format. Repeated and burst captures become an animation, every frame holds only the changed sub-rectangle\n" \
+"-P or --palette <arg> : 8-bit palette of gif and of bitmap (-b) outputs: 332 (3-3-2 bits) or web (6x6x6 colors). Default: 332\n" \
+"-x or --dither <noarg> : ordered dither for palette outputs\n" \
 "-t or --thread <noarg> : Use all cores of the processor. It may affect on multicore systems on bigger screens. (only PGM and PPM for now)\n" \
+"-r or --repeat <arg> : capture repeatedly. 0 means until interrupted. Unchanged frames are skipped, changed row bands are updated in place\n" \
+"-w or --wait <arg> : milliseconds to wait between repeated captures. Default: 0\n" \
+"-a or --all <noarg> : write every repeated frame even if nothing changed\n" \
+"-s or --stats <optarg> : print per frame change statistics and dirty rectangles as json lines, with -G the changed sub-rectangle of the palette frame. Default: stderr, otherwise the given sidecar file (--stats=file)\n" \
+"-p or --probe <optarg> : don't write an image. Print mean luma, histogram, near-black fraction and content hashes of the frame and of a region grid as one json line. Default grid: 4x4 (--probe=CxR)\n" \
+"-H or --phash <noarg> : add an 8x8 perceptual (average) hash to the probe result\n" \
+"-q or --queue <arg> : pipelined repeat mode. snapshot, conversion and output run concurrently, connected by queues of this depth\n" \
+"-D or --drop <arg> : what a full pipeline queue does: block, oldest or newest. Default: block\n" \
+"-B or --burst <arg> : capture N frames back to back into a preallocated arena, convert and write them afterwards. N[,huge][,lock]: hugepage backed, locked with mlock. Use a %%d pattern in the output file name for one file per frame\n" \
+"-n or --nice <optional arg> : background capture, every thread runs under SCHED_IDLE (idle, default) or SCHED_BATCH (batch)\n" \
+"-u or --budget <arg> : background capture within PERCENT of one core. Conversion runs in row bands and sleeps between them, the capture latency is reported. Implies --nice=batch\n" \
+"-A or --affinity <arg> : cpus of the capture threads, ex: 0 or 1-3 or 0,2. -t starts one thread per cpu\n" \
+"-T or --tune <noarg> : measure thread counts, band heights and staging copy vs direct reads on this device and format, save the fastest one into $FBO_PROFILES (default ~/.fbo_profiles). Later captures load it at startup, -t, -A and -u keep their own thread count. Not with -p, -q, -B or several/converted outputs\n" \
 "Don't mix color options! \n"
 
 // file types
@@ -69,19 +201,50 @@ INTRO "\n" \
 #define Bmp "bmp"
 #define Bmpc "bmpc"
 #define Bmpg "bmpg"
+#define Bmpp "bmpp"
+#define Gif "gif"
 
 // exit codes
 #define EXIT_POSIX_ERROR 2
 #define EXIT_NOT_SUPPORTED 3
 #define EXIT_HELP 4
 
+// change detection
+#define TILE_WIDTH 64 // pixels. multiple of 8 so that 1 bpp tiles are byte aligned
+#define TILE_HEIGHT 16 // rows. also the height of a dirty row band
+#define MAX_HEADER_SIZE 2048
+
+// probe
+#define PROBE_NEAR_BLACK 16 // luma values below this are near-black
+#define PHASH_SIZE 8 // 8x8 average hash, 64 bits
+
+// multi-resolution outputs
+#define MAX_OUTPUTS 8
+#define OUTPUT_BAND_ROWS 16 // framebuffer rows converted into every output before moving on
+
+// burst
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+// background capture
+#define BUDGET_BAND_ROWS 16 // rows converted between two CPU time checks
+
+// gif
+#define GIF_CLEAR 256
+#define GIF_EOI 257
+#define GIF_MAX_CODE 4095
+#define GIF_HASH_SIZE 5003 // prime, a bit more than the 4096 codes
+
 typedef struct fb_fix_screeninfo fsi;
 typedef struct fb_var_screeninfo vsi;
 typedef struct fb_cmap cmap;
 typedef struct ThreadData ThreadData;
+typedef struct Probe Probe;
+typedef struct Output Output;
+typedef struct Burst Burst;
 typedef void* (*ProcessRows)(void*);
 typedef void (*ProcessRowCallback)(uint32_t y, ThreadData *data, uint8_t *row);
 static bool black_is_zero = false;
+static bool vmsplice_failed = false; // pipe output falls back to write()
 
 typedef enum tagFileType{
     // NetPbm
@@ -91,9 +254,27 @@ typedef enum tagFileType{
     // Bmp
     BMP, // indicated BMPC
     BMPG, // 0-255 // grayscale
-    BMPC // colored
+    BMPC, // colored
+    BMPP, // 0-255 // palette
+    // Gif
+    GIF // palette, animated
 }FileType;
 
+typedef enum tagPalette{
+    PALETTE_332, // 3 bits red, 3 bits green, 2 bits blue
+    PALETTE_WEB // 6x6x6 web safe colors
+}Palette;
+static Palette palette = PALETTE_332;
+static bool dither = false;
+static uint32_t cpu_budget = 0; // percent of one core, 0 is unlimited
+static uint32_t work_band_rows = 0; // rows a thread takes at a time, 0 is an equal static split
+
+typedef enum tagDropPolicy{
+    DROP_BLOCK, // wait for the next stage
+    DROP_OLDEST, // replace the oldest queued frame
+    DROP_NEWEST // discard the new frame
+}DropPolicy;
+
 // wingdi-bitmap structure document
 #pragma pack(push, 1)
 typedef struct {
@@ -117,9 +298,9 @@ typedef struct {
   uint32_t biClrImportant;
 } BITMAPINFOHEADER;
 #pragma pack(pop)
-// fill the blanks as you wish
+// templates, makeBmpHeader fills the blanks in its own copies
 /// BMP file header
-static BITMAPFILEHEADER file_header = {
+static const BITMAPFILEHEADER file_header = {
     .bfType = 0x4D42,  // 'BM'
     // .bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + image_size,
     .bfReserved1 = 0,
@@ -127,7 +308,7 @@ static BITMAPFILEHEADER file_header = {
     .bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)
 };
 /// BMP info header
-static BITMAPINFOHEADER info_header = {
+static const BITMAPINFOHEADER info_header = {
     .biSize = sizeof(BITMAPINFOHEADER),
     // .biWidth = width,
     // .biHeight = -height, // top-down BMP
@@ -142,6 +323,18 @@ static BITMAPINFOHEADER info_header = {
 };
 
 // utility functions
+static inline bool fileTypeFromName(const char *name, size_t length, FileType *type) {
+    static const struct { const char *name; FileType type; } names[] = {
+        {PBM, P4}, {PGM, P5}, {PPM, P6}, {Bmp, BMP}, {Bmpc, BMPC}, {Bmpg, BMPG}, {Bmpp, BMPP}
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (strlen(names[i].name) == length && strncasecmp(name, names[i].name, length) == 0) {
+            *type = names[i].type;
+            return true;
+        }
+    }
+    return false;
+}
 static inline void posixError(const char *s, ...) {
     va_list argv;
     va_start(argv, s);
@@ -207,15 +400,83 @@ static inline void print_var_info(struct fb_var_screeninfo vinfo) {
     fprintf(stderr, "Rotate: %d\n", vinfo.rotate);
     fprintf(stderr, "Colorspace: %d\n", vinfo.colorspace);
 }
+// pixel format of the row kernels, constants in a single format build
+static inline uint32_t pixelBits(const vsi *info) {
+#ifdef FBO_FIXED_BPP
+    (void)info;
+    return FBO_FIXED_BPP;
+#else
+    return info->bits_per_pixel;
+#endif
+}
+static inline uint32_t pixelBytes(const vsi *info) {
+    return (pixelBits(info) + 7) / 8;
+}
+#ifdef FIXED_LAYOUT_BPP
+static const struct fb_bitfield fixed_red = {FIXED_RED_OFFSET, FIXED_RED_LENGTH, 0};
+static const struct fb_bitfield fixed_green = {FIXED_GREEN_OFFSET, FIXED_GREEN_LENGTH, 0};
+static const struct fb_bitfield fixed_blue = {FIXED_BLUE_OFFSET, FIXED_BLUE_LENGTH, 0};
+#define RED_FIELD(info) (&fixed_red)
+#define GREEN_FIELD(info) (&fixed_green)
+#define BLUE_FIELD(info) (&fixed_blue)
+#else
+#define RED_FIELD(info) (&(info)->red)
+#define GREEN_FIELD(info) (&(info)->green)
+#define BLUE_FIELD(info) (&(info)->blue)
+#endif
+static inline bool formatEnabled(FileType type) {
+    switch (type) {
+    case P4:
+        return FORMAT_P4;
+    case P5:
+        return FORMAT_P5;
+    case P6:
+        return FORMAT_P6;
+    case BMPG:
+        return FORMAT_BMPG;
+    case BMP:
+    case BMPC:
+        return FORMAT_BMPC;
+    case BMPP:
+        return FORMAT_BMPP;
+    case GIF:
+        return FORMAT_GIF;
+    default:
+        return false;
+    }
+}
+static inline void checkBuildFormat(const vsi *info) {
+    // a single format build refuses every other device
+#ifdef FBO_FIXED_BPP
+    if (info->bits_per_pixel != FBO_FIXED_BPP) {
+        fprintf(stderr, "fbo: built for %d bpp (FBO_FIXED_BPP) but the framebuffer is %" PRIu32 " bpp\n",
+                FBO_FIXED_BPP, info->bits_per_pixel);
+        exit(EXIT_NOT_SUPPORTED);
+    }
+#endif
+#ifdef FIXED_LAYOUT_BPP
+    if (info->red.offset != FIXED_RED_OFFSET || info->red.length != FIXED_RED_LENGTH ||
+        info->green.offset != FIXED_GREEN_OFFSET || info->green.length != FIXED_GREEN_LENGTH ||
+        info->blue.offset != FIXED_BLUE_OFFSET || info->blue.length != FIXED_BLUE_LENGTH) {
+        fprintf(stderr, "fbo: built for another channel layout (FBO_FIXED_LAYOUT), "
+                "the framebuffer is red %" PRIu32 "/%" PRIu32 " green %" PRIu32 "/%" PRIu32 " blue %" PRIu32 "/%" PRIu32 "\n",
+                info->red.offset, info->red.length, info->green.offset, info->green.length,
+                info->blue.offset, info->blue.length);
+        exit(EXIT_NOT_SUPPORTED);
+    }
+#endif
+    (void)info;
+}
 static inline uint8_t getColor(uint32_t pixel, const struct fb_bitfield *bitfield,
                                uint16_t *colormap) {
     return colormap[(pixel >> bitfield->offset) & ((1 << bitfield->length) - 1)] >> 8;
 }
 static inline uint8_t getGrayscale(uint32_t pixel, const vsi *info,
                                    const cmap *colormap) {
-    const uint8_t red = colormap->red[(pixel >> info->red.offset) & ((1 << info->red.length) - 1)] >> 8;
-    const uint8_t green = colormap->green[(pixel >> info->green.offset) & ((1 << info->green.length) - 1)] >> 8;
-    const uint8_t blue = colormap->blue[(pixel >> info->blue.offset) & ((1 << info->blue.length) - 1)] >> 8;
+    (void)info; // unused in a single format build
+    const uint8_t red = getColor(pixel, RED_FIELD(info), colormap->red);
+    const uint8_t green = getColor(pixel, GREEN_FIELD(info), colormap->green);
+    const uint8_t blue = getColor(pixel, BLUE_FIELD(info), colormap->blue);
     return (uint8_t)(0.3 * red + 0.59 * green + 0.11 * blue);
 }
 static inline uint8_t reverseBits(uint8_t b) {
@@ -238,36 +499,121 @@ static inline uint8_t reverseBits(uint8_t b) {
    */
     return (b * 0x0202020202ULL & 0x010884422010ULL) % 1023;
 }
-static inline void writeBmpHeader(uint32_t image_size, uint32_t width, uint32_t height, uint16_t bit_count, FILE *fp) {
+static inline size_t makeBmpHeader(uint8_t *header, uint32_t image_size, uint32_t width, uint32_t height, uint16_t bit_count,
+                                   const uint8_t (*colors)[3]) {
+    // colors: palette of 8 bit images, NULL is grayscale
     //BITMAPFILEHEADER file_header = {0x4D42, sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + image_size, 0, 0, sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)};
     //BITMAPINFOHEADER info_header = {sizeof(BITMAPINFOHEADER), width, -height, 1, bit_count, 0, image_size, 0, 0, (bit_count == 8) ? 256 : 0, (bit_count == 8) ? 256 : 0};
+    // local copies of the templates, several threads build headers at once in burst mode
+    const uint32_t palette_size = (bit_count == 8) ? 256 * 4 : 0;
+    BITMAPFILEHEADER file_hdr = file_header;
+    BITMAPINFOHEADER info_hdr = info_header;
 
            // BMP file header
-    file_header.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + image_size;
+    file_hdr.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + palette_size + image_size;
+    file_hdr.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + palette_size;
 
            // BMP info header
-    info_header.biWidth = width;
-    info_header.biHeight = -height; // top-down BMP
-    info_header.biBitCount = bit_count;
-    info_header.biSizeImage = image_size;
-    info_header.biClrUsed = info_header.biClrImportant =
+    info_hdr.biWidth = width;
+    info_hdr.biHeight = -height; // top-down BMP
+    info_hdr.biBitCount = bit_count;
+    info_hdr.biSizeImage = image_size;
+    info_hdr.biClrUsed = info_hdr.biClrImportant =
         (bit_count == 8) ? 256 : 0; // only 256 color range important : all colors are important
 
-    if(fwrite(&file_header, sizeof(file_header), 1, fp) != 1){
-      posixError("write error");
-    }
-    if(fwrite(&info_header, sizeof(info_header), 1, fp) != 1){
-      posixError("write error");
-    }
+    memcpy(header, &file_hdr, sizeof(file_header));
+    memcpy(header + sizeof(file_header), &info_hdr, sizeof(info_header));
+    uint8_t *color = header + sizeof(file_header) + sizeof(info_header);
 
     if (bit_count == 8) {
       for (uint32_t i = 0; i < 256; ++i) {
-        uint8_t color[4] = {i, i, i, 0};
-        if(fwrite(color, sizeof(color), 1, fp) != 1){
-          posixError("write error");
+        if (colors) {
+          color[i * 4 + 0] = colors[i][2];
+          color[i * 4 + 1] = colors[i][1];
+          color[i * 4 + 2] = colors[i][0];
+        } else {
+          color[i * 4 + 0] = color[i * 4 + 1] = color[i * 4 + 2] = i;
         }
+        color[i * 4 + 3] = 0;
       }
     }
+    return sizeof(file_header) + sizeof(info_header) + palette_size;
+}
+
+#define HASH_PRIME1 0x9E3779B1U
+#define HASH_PRIME2 0x85EBCA77U
+#define HASH_PRIME3 0xC2B2AE3DU
+#define HASH_PRIME4 0x27D4EB2FU
+#define HASH_PRIME5 0x165667B1U
+static inline uint32_t rotl32(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+static inline uint32_t hashBytes(const uint8_t *p, size_t len, uint32_t seed) {
+    /* xxHash32 style hash. Four independent lanes eat 16 bytes per round,
+     * one NEON quad register per round on ARM.
+     * Only used for change detection and content ids, not cryptography.
+     */
+    const uint8_t *end = p + len;
+    uint32_t h;
+
+    if (len >= 16) {
+        uint32_t lanes[4] = {
+            seed + HASH_PRIME1 + HASH_PRIME2,
+            seed + HASH_PRIME2,
+            seed,
+            seed - HASH_PRIME1
+        };
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+        uint32x4_t acc = vld1q_u32(lanes);
+        const uint32x4_t prime1 = vdupq_n_u32(HASH_PRIME1);
+        const uint32x4_t prime2 = vdupq_n_u32(HASH_PRIME2);
+        for (; end - p >= 16; p += 16) {
+            acc = vmlaq_u32(acc, vreinterpretq_u32_u8(vld1q_u8(p)), prime2);
+            acc = vsriq_n_u32(vshlq_n_u32(acc, 13), acc, 19);
+            acc = vmulq_u32(acc, prime1);
+        }
+        vst1q_u32(lanes, acc);
+#else
+        for (; end - p >= 16; p += 16) {
+            for (uint32_t i = 0; i < 4; ++i) {
+                uint32_t in;
+                memcpy(&in, p + i * 4, sizeof(in)); // framebuffer rows may be unaligned
+                lanes[i] = rotl32(lanes[i] + le32toh(in) * HASH_PRIME2, 13) * HASH_PRIME1;
+            }
+        }
+#endif
+        h = rotl32(lanes[0], 1) + rotl32(lanes[1], 7) + rotl32(lanes[2], 12) + rotl32(lanes[3], 18);
+    } else {
+        h = seed + HASH_PRIME5;
+    }
+    h += (uint32_t)len;
+
+    for (; end - p >= 4; p += 4) {
+        uint32_t in;
+        memcpy(&in, p, sizeof(in));
+        h = rotl32(h + le32toh(in) * HASH_PRIME3, 17) * HASH_PRIME4;
+    }
+    for (; p < end; ++p) {
+        h = rotl32(h + *p * HASH_PRIME5, 11) * HASH_PRIME1;
+    }
+
+    h ^= h >> 15;
+    h *= HASH_PRIME2;
+    h ^= h >> 13;
+    h *= HASH_PRIME3;
+    h ^= h >> 16;
+    return h;
+}
+static inline double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+static inline double cpuMs(clockid_t clock) {
+    // CLOCK_THREAD_CPUTIME_ID or CLOCK_PROCESS_CPUTIME_ID
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
 }
 
 typedef struct ThreadData{
@@ -283,12 +629,208 @@ typedef struct ThreadData{
     ProcessRowCallback processRowCallback;
     //BMP
     uint16_t bit_count;
+    // change detection
+    uint32_t *hashes;
+    // output file
+    ProcessRows processRows;
+    int fd;
+    off_t file_offset;
+    // probe
+    Probe *probe;
+    // multi-resolution outputs
+    Output *outputs;
+    uint32_t num_outputs;
+    uint32_t band_rows;
+    const Output *output;
+    // burst
+    const Burst *burst;
+    // background capture
+    ProcessRows budgetedRows;
+    uint32_t budget_band;
+    double budget; // percent of one core for this thread
+    // dynamic bands
+    ProcessRows bandedRows;
+    uint32_t work_band;
+    uint32_t end_row;
+    atomic_uint *next_row;
 } ThreadData;
 typedef struct ThreadNode {
     pthread_t thread;
     ThreadData data;
     struct ThreadNode *next;
 } ThreadNode;
+/// Converted image layout of one FileType
+typedef struct ImageFormat {
+    ProcessRows processRows;
+    ProcessRowCallback processRowCallback;
+    uint32_t row_step;
+    uint16_t bit_count;
+    uint32_t image_size;
+    size_t header_size;
+    uint8_t header[MAX_HEADER_SIZE];
+} ImageFormat;
+/// One retained converted image
+typedef struct FrameSlot {
+    uint8_t *buffer;
+    uint64_t frame; // the buffer holds this frame
+    bool valid;
+} FrameSlot;
+/// LZW code writer of a gif image
+typedef struct GifBits {
+    FILE *fp;
+    uint32_t buffer;
+    uint32_t count; // bits in buffer
+    uint8_t block[255];
+    uint32_t block_size;
+} GifBits;
+/// Animated gif state between frames
+typedef struct GifWriter {
+    uint32_t width;
+    uint32_t height;
+    uint8_t *current; // palette indices of the new frame
+    uint8_t *pending; // palette indices of the frame waiting for its delay
+    uint32_t left, top, right, bottom; // changed sub-rectangle of the pending frame
+    bool changed; // false: the pending frame equals the one before, the sub-rectangle is a single pixel
+    double compare_ms; // finding the sub-rectangle, for --stats
+    double timestamp; // ms, capture time of the pending frame
+    double last_interval; // ms
+    bool started;
+    bool animated;
+} GifWriter;
+/// Best capture settings of a device, resolution and format, see --tune
+typedef struct Profile {
+    uint32_t threads;
+    uint32_t band_rows; // 0: equal static split
+    bool staging; // snapshot the mapping into cached memory before converting
+    double ms; // per frame
+} Profile;
+/// Framebuffer without hardware, see openVirtualDevice
+typedef struct VirtualDevice {
+    bool enabled;
+    struct fb_fix_screeninfo fix;
+    vsi var;
+    uint16_t colormap[3][256];
+} VirtualDevice;
+/// One of several outputs captured from a single pass over the framebuffer
+typedef struct Output {
+    char *file_name;
+    FILE *fp;
+    FileType type;
+    bool has_type; // given with :format=
+    bool extension_type; // guessed from the file name, used when there are several outputs or a scaled one
+    uint32_t scale; // 1/scale of the framebuffer resolution
+    vsi info; // output resolution
+    ImageFormat format;
+    ProcessRows processRows;
+    uint8_t *buffer;
+    uint8_t *map;
+} Output;
+/// State kept between repeated captures
+typedef struct FrameHistory {
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    uint32_t *hashes; // tiles_x * tiles_y, previous frame
+    uint32_t *next_hashes; // tiles_x * tiles_y, current frame
+    uint8_t *dirty_tiles;
+    uint8_t *dirty_bands; // one per TILE_HEIGHT rows, bands to convert into the current slot
+    uint64_t *band_changes; // frame of the last change of every band
+    FrameSlot *slots; // more than one while a pipe may still reference spliced pages
+    uint32_t num_slots;
+    uint32_t next_slot;
+    uint8_t *map; // memory-mapped output file, the only slot points into it
+    size_t map_size;
+    bool in_place; // output is a regular file updated in place
+    uint64_t frame;
+    bool valid; // hashes hold a previous frame
+    bool write_unchanged;
+    FILE *stats;
+    GifWriter gif;
+} FrameHistory;
+/// Screen health statistics of one frame
+typedef struct Probe {
+    pthread_mutex_t lock;
+    uint32_t regions_x;
+    uint32_t regions_y;
+    uint32_t *segment_hashes; // yres * regions_x, raw row segment of every region column
+    bool phash;
+    uint64_t luma_sum;
+    uint64_t near_black;
+    uint64_t histogram[256];
+    uint64_t phash_sums[PHASH_SIZE * PHASH_SIZE];
+} Probe;
+/// Frames captured back to back before anything is encoded
+typedef struct Burst {
+    uint32_t count;
+    bool huge; // hugepage backed arena
+    bool lock; // mlock the arena
+    GifWriter gif;
+    // source
+    bool mmapped;
+    int fd_device;
+    size_t buffer_size;
+    off_t visible_offset;
+    // packed snapshots of the visible area
+    vsi raw_info;
+    uint32_t raw_line_length;
+    size_t frame_size;
+    uint8_t *arena;
+    size_t arena_size;
+    double *timestamps; // ms
+    // output
+    FileType imageFileFormat;
+    char *pattern; // file name per frame, otherwise the frames are streamed to the output
+    FILE *stats;
+} Burst;
+/// Pooled frame buffer passed between pipeline stages
+typedef struct Frame {
+    uint8_t *data; // raw snapshot or converted image (header in front of it)
+    uint64_t number;
+    double timestamp; // ms, when the snapshot was taken
+} Frame;
+/// Bounded lock-free single-producer/single-consumer queue.
+/// head is also advanced by the producer when it drops the oldest frame.
+typedef struct FrameQueue {
+    _Atomic(Frame *) *slots;
+    uint32_t capacity;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t drops;
+    _Atomic uint32_t max_depth;
+} FrameQueue;
+/// Concurrent snapshot -> convert -> output stages of repeated capture
+typedef struct Pipeline {
+    // source
+    const vsi *info;
+    const cmap *colormap;
+    uint32_t line_length;
+    bool mmapped;
+    int fd_device;
+    size_t buffer_size;
+    off_t visible_offset;
+    // packed snapshot of the visible area
+    vsi raw_info;
+    uint32_t raw_line_length;
+    // output
+    FileType imageFileFormat;
+    ImageFormat format;
+    FILE *fp;
+    FILE *stats;
+    uint32_t num_threads;
+    uint32_t depth;
+    uint32_t splice_delay;
+    DropPolicy policy;
+    FrameQueue raw_queue;
+    FrameQueue raw_pool;
+    FrameQueue out_queue;
+    FrameQueue out_pool;
+    atomic_bool capture_done;
+    atomic_bool convert_done;
+    // counters
+    uint64_t captured;
+    uint64_t written;
+    double latency_sum;
+    double latency_max;
+} Pipeline;
 
 // PBM, PGM, PPM
 void* processPbmRows(void *arg) {
@@ -318,7 +860,7 @@ void* processPbmRows(void *arg) {
 }
 void* processPgmRows(void *arg) {
     ThreadData *data = (ThreadData *)arg;
-    const uint32_t bytes_per_pixel = (data->info->bits_per_pixel + 7) / 8;
+    const uint32_t bytes_per_pixel = pixelBytes(data->info);
     const uint32_t width = data->info->xres;
     // const uint32_t height = data->info->yres;
     uint8_t *row = data->buffer + data->start_row * data->row_step;
@@ -339,7 +881,7 @@ void* processPgmRows(void *arg) {
                 break;
             default:
                 for (uint32_t i = 0; i < bytes_per_pixel; ++i) {
-                    pixel |= current[0] << (i * sizeof(typeof(row)));
+                    pixel |= current[0] << (i * 8);
                     current++;
                 }
                 break;
@@ -350,11 +892,59 @@ void* processPgmRows(void *arg) {
     }
     return NULL;
 }
+void* processLumaRows(void *arg) {
+    // Probe only: integer luma through per channel tables of weighted colormap values,
+    // getGrayscale weights (0.3, 0.59, 0.11) in 16 bit fixed point.
+    // Unlike the output kernels the first row lands at buffer, not at start_row * row_step.
+    ThreadData *data = (ThreadData *)arg;
+    const vsi *info = data->info;
+    const uint32_t bytes_per_pixel = pixelBytes(info);
+    const uint32_t width = info->xres;
+    const struct fb_bitfield red = *RED_FIELD(info), green = *GREEN_FIELD(info), blue = *BLUE_FIELD(info);
+    const uint32_t red_mask = (1U << red.length) - 1, green_mask = (1U << green.length) - 1, blue_mask = (1U << blue.length) - 1;
+    uint32_t red_luma[256], green_luma[256], blue_luma[256];
+    uint8_t *row = data->buffer;
+
+    for (uint32_t i = 0; i <= red_mask; ++i)
+        red_luma[i] = 19661 * (data->colormap->red[i] >> 8);
+    for (uint32_t i = 0; i <= green_mask; ++i)
+        green_luma[i] = 38666 * (data->colormap->green[i] >> 8);
+    for (uint32_t i = 0; i <= blue_mask; ++i)
+        blue_luma[i] = 7209 * (data->colormap->blue[i] >> 8);
+
+    for (uint32_t y = data->start_row; y < data->start_row + data->num_rows; ++y) {
+        const uint8_t *current = data->video_memory + (y + info->yoffset) * data->line_length +
+                                 info->xoffset * bytes_per_pixel;
+        for (uint32_t x = 0; x < width; ++x) {
+            uint32_t pixel = 0;
+            switch (bytes_per_pixel) {
+            case 4:
+                pixel = le32toh(*((uint32_t *)current));
+                current += 4;
+                break;
+            case 2:
+                pixel = le16toh(*((uint16_t *)current));
+                current += 2;
+                break;
+            default:
+                for (uint32_t i = 0; i < bytes_per_pixel; ++i) {
+                    pixel |= current[0] << (i * 8);
+                    current++;
+                }
+                break;
+            }
+            row[x] = (red_luma[(pixel >> red.offset) & red_mask] + green_luma[(pixel >> green.offset) & green_mask] +
+                      blue_luma[(pixel >> blue.offset) & blue_mask]) >> 16;
+        }
+        row += data->row_step;
+    }
+    return NULL;
+}
 void* processPpmRows(void *arg) {
     // Framebuffer channel order BGR but P6 channel order is RGB!
     // So that RED <-> BLUE channels has to swap
     ThreadData *data = (ThreadData *)arg;
-    const uint32_t bytes_per_pixel = (data->info->bits_per_pixel + 7) / 8;
+    const uint32_t bytes_per_pixel = pixelBytes(data->info);
     const uint32_t width = data->info->xres;
     // const uint32_t height = data->info->yres;
     uint8_t *row = data->buffer + data->start_row * data->row_step;
@@ -375,16 +965,16 @@ void* processPpmRows(void *arg) {
                 break;
             default:
                 for (uint32_t i = 0; i < bytes_per_pixel; ++i) {
-                    pixel |= *current << (i * sizeof(typeof(row)));
+                    pixel |= *current << (i * 8);
                     current++;
                 }
                 break;
             }
 
             /*
-            row[x * 3 + 0] = getColor(pixel, &data->info->red, data->colormap->red);
-            row[x * 3 + 1] = getColor(pixel, &data->info->green, data->colormap->green);
-            row[x * 3 + 2] = getColor(pixel, &data->info->blue, data->colormap->blue);
+            row[x * 3 + 0] = getColor(pixel, RED_FIELD(data->info), data->colormap->red);
+            row[x * 3 + 1] = getColor(pixel, GREEN_FIELD(data->info), data->colormap->green);
+            row[x * 3 + 2] = getColor(pixel, BLUE_FIELD(data->info), data->colormap->blue);
             // row[x * 3 + 3] = getColor(pixel, &data->info->transp, data->colormap->transp);
             */
 
@@ -392,11 +982,11 @@ void* processPpmRows(void *arg) {
             // row[x * 3] = pixel; // red <-> blue colors changed.
             // row[x * 3] = (getColor(...; // memory alignment problem with "uint32_t* row"!
             pixel =
-                (getColor(pixel, &data->info->red, data->colormap->red) << 0) |
-                (getColor(pixel, &data->info->green, data->colormap->green) << 8) |
-                (getColor(pixel, &data->info->blue, data->colormap->blue) << 16);
+                (getColor(pixel, RED_FIELD(data->info), data->colormap->red) << 0) |
+                (getColor(pixel, GREEN_FIELD(data->info), data->colormap->green) << 8) |
+                (getColor(pixel, BLUE_FIELD(data->info), data->colormap->blue) << 16);
                 // (getColor(pixel, &data->info->transp, data->colormap->transp) << 24);
-            memmove(&row[x * 3], &pixel, sizeof(pixel));
+            memmove(&row[x * 3], &pixel, (sizeof(pixel)-1)); // 3 bytes, the 4th one would spill into the next row
         }
         row += data->row_step; // /(sizeof(typeof(row))/sizeof(uint8_t));
     }
@@ -405,7 +995,7 @@ void* processPpmRows(void *arg) {
 // BMP
 void* processBmpGrayscaleRows(void *arg){
     ThreadData *data = (ThreadData *)arg;
-    const uint32_t bytes_per_pixel = (data->info->bits_per_pixel + 7) / 8;
+    const uint32_t bytes_per_pixel = pixelBytes(data->info);
     const uint32_t width = data->info->xres;
     // const uint32_t height = data->info->yres;
     // const uint32_t image_size = height * data->row_step;
@@ -428,7 +1018,7 @@ void* processBmpGrayscaleRows(void *arg){
                 break;
             default:
                 for (uint32_t i = 0; i < bytes_per_pixel; ++i) {
-                    pixel |= *current << (i * sizeof(typeof(row)));
+                    pixel |= *current << (i * 8);
                     ++current;
                 }
                 break;
@@ -441,10 +1031,11 @@ void* processBmpGrayscaleRows(void *arg){
     return NULL;
 }
 void processBmpColoredRow(uint32_t y, ThreadData *data, uint8_t *row){
-    const uint8_t *current = data->video_memory + (y + data->info->yoffset) * data->line_length + data->info->xoffset * data->bytes_per_pixel;
+    const uint32_t bytes_per_pixel = pixelBytes(data->info);
+    const uint8_t *current = data->video_memory + (y + data->info->yoffset) * data->line_length + data->info->xoffset * bytes_per_pixel;
     for (uint32_t x = 0; x < data->info->xres; ++x) {
         uint32_t pixel = 0;
-        switch (data->bytes_per_pixel) {
+        switch (bytes_per_pixel) {
         case 4:
             pixel = le32toh(*((uint32_t *) current));
             current += 4;
@@ -454,27 +1045,29 @@ void processBmpColoredRow(uint32_t y, ThreadData *data, uint8_t *row){
             current += 2;
             break;
         default:
-            for (unsigned int i = 0; i < data->bytes_per_pixel; ++i) {
-                pixel |= *current << (i * sizeof(typeof(row)));
+            for (unsigned int i = 0; i < bytes_per_pixel; ++i) {
+                pixel |= *current << (i * 8);
                 ++current;
             }
             break;
         }
-        memmove(&row[x * 3], &pixel, sizeof(pixel));
+        row[x * 3 + 0] = getColor(pixel, BLUE_FIELD(data->info), data->colormap->blue);
+        row[x * 3 + 1] = getColor(pixel, GREEN_FIELD(data->info), data->colormap->green);
+        row[x * 3 + 2] = getColor(pixel, RED_FIELD(data->info), data->colormap->red);
     }
 }
 void* processBmpColoredRows(void *arg){
     ThreadData *data = (ThreadData *)arg;
-    const uint32_t bytes_per_pixel = (data->info->bits_per_pixel + 7) / 8;
+    const uint32_t bytes_per_pixel = pixelBytes(data->info);
     const uint32_t width = data->info->xres;
     // const uint32_t height = data->info->yres;
     // const uint32_t image_size = height * data->row_step;
-    const uint8_t *row = data->buffer + data->start_row * data->row_step;
+    uint8_t *row = data->buffer + data->start_row * data->row_step;
     const uint32_t xoffset = data->info->xoffset * bytes_per_pixel;
-    const uint32_t yoffset = data->info->yoffset * data->line_length;
+    const uint32_t yoffset = data->info->yoffset;
 
     for (uint32_t y = data->start_row; y < data->start_row + data->num_rows; ++y) {
-        const uint8_t *current = data->video_memory + (y + yoffset) * data->line_length + xoffset * bytes_per_pixel;
+        const uint8_t *current = data->video_memory + (y + yoffset) * data->line_length + xoffset;
         for (uint32_t x = 0; x < width; ++x) {
             uint32_t pixel = 0;
             switch (bytes_per_pixel) {
@@ -488,22 +1081,48 @@ void* processBmpColoredRows(void *arg){
                 break;
             default:
                 for (uint32_t i = 0; i < bytes_per_pixel; ++i) {
-                    pixel |= *current << (i * sizeof(typeof(row)));
+                    pixel |= *current << (i * 8);
                     ++current;
                 }
                 break;
             }
-            /*
-            pixel =
-                (getColor(pixel, &data->info->red, data->colormap->red) << 0) |
-                (getColor(pixel, &data->info->blue, data->colormap->blue) << 8) |
-                (getColor(pixel, &data->info->green, data->colormap->green) << 16);
-            */
-            // (getColor(pixel, &data->info->transp, data->colormap->transp) << 24);
-            memmove(&row[x * 3], &pixel, (sizeof(pixel)-1));
+            // BMP channel order is BGR whatever the framebuffer layout is
+            row[x * 3 + 0] = getColor(pixel, BLUE_FIELD(data->info), data->colormap->blue);
+            row[x * 3 + 1] = getColor(pixel, GREEN_FIELD(data->info), data->colormap->green);
+            row[x * 3 + 2] = getColor(pixel, RED_FIELD(data->info), data->colormap->red);
+        }
+        row += data->row_step;
+    }
+    return NULL;
+}
+
+void* processMonoBmpRows(void *arg){
+    // 1 bpp framebuffers: the PBM kernel packs a scratch row, every bit becomes a gray byte (BMPG)
+    // or a BGR pixel (BMPC)
+    ThreadData *data = (ThreadData *)arg;
+    const uint32_t width = data->info->xres;
+    const uint32_t bytes_per_pixel = data->bit_count / 8;
+    uint8_t *row = data->buffer + data->start_row * data->row_step;
+    uint8_t *packed = (uint8_t *)malloc((width + 7) / 8);
+    if (packed == NULL) {
+        posixError("malloc failed");
+    }
+
+    ThreadData row_data = *data;
+    row_data.buffer = packed;
+    row_data.row_step = 0; // every row lands on the scratch row
+    row_data.num_rows = 1;
+    for (uint32_t y = data->start_row; y < data->start_row + data->num_rows; ++y) {
+        row_data.start_row = y;
+        processPbmRows(&row_data);
+        for (uint32_t x = 0; x < width; ++x) {
+            // P4: 1 is black
+            memset(&row[x * bytes_per_pixel], ((packed[x / 8] >> (7 - x % 8)) & 1) ? 0 : 255, bytes_per_pixel);
         }
         row += data->row_step;
     }
+
+    free(packed);
     return NULL;
 }
 
@@ -519,159 +1138,2154 @@ void* process(void *arg){
 
     return NULL;
 }
+// palette output
+static const uint8_t bayer4x4[4][4] = {
+    { 0,  8,  2, 10},
+    {12,  4, 14,  6},
+    { 3, 11,  1,  9},
+    {15,  7, 13,  5}
+};
+static inline int32_t clampColor(int32_t value) {
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+static inline int32_t paletteLevel(int32_t color, int32_t levels) {
+    // (color * levels + 127) / 255 rounded to the nearest level, the division as multiply-shift
+    const int32_t value = color * levels + 127;
+    return (value + (value >> 8) + 1) >> 8;
+}
+static inline int32_t ditherOffset(uint32_t channel, uint32_t x, uint32_t y) {
+    // the ordered dither moves the value up to half a palette level of the channel
+    static const int32_t half_levels[2][3] = {
+        [PALETTE_332] = {36, 36, 85},
+        [PALETTE_WEB] = {51, 51, 51}
+    };
+    return dither ? (bayer4x4[y & 3][x & 3] * 2 - 15) * half_levels[palette][channel] / 32 : 0;
+}
+static inline uint8_t quantizePixel(uint8_t red, uint8_t green, uint8_t blue, uint32_t x, uint32_t y) {
+    // nearest palette level
+    const int32_t r = clampColor(red + ditherOffset(0, x, y));
+    const int32_t g = clampColor(green + ditherOffset(1, x, y));
+    const int32_t b = clampColor(blue + ditherOffset(2, x, y));
+    if (palette == PALETTE_WEB) {
+        return paletteLevel(r, 5) * 36 + paletteLevel(g, 5) * 6 + paletteLevel(b, 5);
+    }
+    return (paletteLevel(r, 7) << 5) | (paletteLevel(g, 7) << 2) | paletteLevel(b, 3);
+}
+static inline int16_t* ditherRows(uint32_t width) {
+    // dither offsets of the four row phases, 3 channels per pixel like the RGB rows
+    int16_t *offsets = (int16_t *)malloc(4 * (size_t)width * 3 * sizeof(int16_t));
+    if (offsets == NULL) {
+        posixError("malloc failed");
+    }
+    for (uint32_t y = 0; y < 4; ++y)
+        for (uint32_t x = 0; x < width; ++x)
+            for (uint32_t channel = 0; channel < 3; ++channel)
+                offsets[((size_t)y * width + x) * 3 + channel] = ditherOffset(channel, x, y);
+    return offsets;
+}
+static inline VECTORIZED_LOOP void quantizeSpan(const uint8_t *restrict rgb, const int16_t *restrict offsets, uint8_t *restrict indices,
+                                size_t width, int32_t red_levels, int32_t green_levels, int32_t blue_levels,
+                                int32_t red_weight, int32_t green_weight) {
+    // no branches, tables or divisions per pixel so the loop vectorizes
+    // (SSSE3 or NEON for the 3 channel loads)
+    for (size_t x = 0; x < width; ++x) {
+        const int32_t r = clampColor(rgb[x * 3 + 0] + offsets[x * 3 + 0]);
+        const int32_t g = clampColor(rgb[x * 3 + 1] + offsets[x * 3 + 1]);
+        const int32_t b = clampColor(rgb[x * 3 + 2] + offsets[x * 3 + 2]);
+        indices[x] = paletteLevel(r, red_levels) * red_weight + paletteLevel(g, green_levels) * green_weight +
+                     paletteLevel(b, blue_levels);
+    }
+}
+static inline VECTORIZED_LOOP void quantizeRow(const uint8_t *rgb, const int16_t *offsets, uint8_t *indices, uint32_t width, uint32_t y) {
+    // same indices as quantizePixel, the palette is chosen once per row
+    offsets += (size_t)(y & 3) * width * 3;
+    if (palette == PALETTE_WEB) {
+        quantizeSpan(rgb, offsets, indices, width, 5, 5, 5, 36, 6);
+    } else {
+        quantizeSpan(rgb, offsets, indices, width, 7, 7, 3, 1 << 5, 1 << 2);
+    }
+}
+static inline void paletteColors(uint8_t colors[256][3]) {
+    memset(colors, 0, 256 * 3);
+    for (uint32_t i = 0; i < 256; ++i) {
+        if (palette == PALETTE_WEB) {
+            if (i >= 216)
+                break;
+            colors[i][0] = (i / 36) * 51;
+            colors[i][1] = (i / 6 % 6) * 51;
+            colors[i][2] = (i % 6) * 51;
+        } else {
+            colors[i][0] = (i >> 5) * 255 / 7;
+            colors[i][1] = ((i >> 2) & 7) * 255 / 7;
+            colors[i][2] = (i & 3) * 255 / 3;
+        }
+    }
+}
+void* processIndexedRows(void *arg){
+    // decodes every row with the PPM kernel and quantizes it to palette indices
+    ThreadData *data = (ThreadData *)arg;
+    const uint32_t width = data->info->xres;
+    uint8_t *row = data->buffer + data->start_row * data->row_step;
+    uint8_t *rgb = (uint8_t *)malloc(width * 3);
+    if (rgb == NULL) {
+        posixError("malloc failed");
+    }
+    int16_t *offsets = ditherRows(width);
+
+    ThreadData row_data = *data;
+    row_data.buffer = rgb;
+    row_data.row_step = 0; // every row lands on the scratch row
+    row_data.num_rows = 1;
+    for (uint32_t y = data->start_row; y < data->start_row + data->num_rows; ++y) {
+        row_data.start_row = y;
+        processPpmRows(&row_data);
+        quantizeRow(rgb, offsets, row, width, y);
+        row += data->row_step;
+    }
+
+    free(offsets);
+    free(rgb);
+    return NULL;
+}
+
+void* processScaledRows(void *arg){
+    // Box filter: every output pixel is the average color of scale x scale framebuffer pixels.
+    // Also converts mono framebuffers to gray/color and color framebuffers to P4.
+    ThreadData *data = (ThreadData *)arg;
+    const Output *output = data->output;
+    const vsi *info = data->info;
+    const uint32_t scale = output->scale;
+    const uint32_t bits_per_pixel = pixelBits(info);
+    const uint32_t bytes_per_pixel = pixelBytes(info);
+    const uint32_t out_width = output->info.xres;
+    const uint32_t end = data->start_row + data->num_rows;
+    uint32_t *sums = (uint32_t *)malloc(out_width * 4 * sizeof(uint32_t)); // red, green, blue, count
+    if (sums == NULL) {
+        posixError("malloc failed");
+    }
+
+    for (uint32_t out_y = data->start_row / scale; out_y * scale < end; ++out_y) {
+        memset(sums, 0, out_width * 4 * sizeof(uint32_t));
+        for (uint32_t y = out_y * scale; y < out_y * scale + scale && y < info->yres; ++y) {
+            const uint8_t *line = data->video_memory + (y + info->yoffset) * data->line_length;
+            const uint8_t *current = line + info->xoffset * bytes_per_pixel;
+            for (uint32_t x = 0; x < info->xres; ++x) {
+                uint32_t *sum = sums + (x / scale) * 4;
+                if (bits_per_pixel == 1) {
+                    // lowest bit is the leftmost pixel, see processPbmRows
+                    const uint32_t bit = info->xoffset + x;
+                    const uint8_t value = (((line[bit / 8] >> (bit % 8)) & 1) ^ black_is_zero) ? 0 : 255;
+                    sum[0] += value;
+                    sum[1] += value;
+                    sum[2] += value;
+                } else {
+                    uint32_t pixel = 0;
+                    switch (bytes_per_pixel) {
+                    case 4:
+                        pixel = le32toh(*((uint32_t *)current));
+                        current += 4;
+                        break;
+                    case 2:
+                        pixel = le16toh(*((uint16_t *)current));
+                        current += 2;
+                        break;
+                    default:
+                        for (uint32_t i = 0; i < bytes_per_pixel; ++i) {
+                            pixel |= *current << (i * 8);
+                            current++;
+                        }
+                        break;
+                    }
+                    sum[0] += getColor(pixel, RED_FIELD(info), data->colormap->red);
+                    sum[1] += getColor(pixel, GREEN_FIELD(info), data->colormap->green);
+                    sum[2] += getColor(pixel, BLUE_FIELD(info), data->colormap->blue);
+                }
+                ++sum[3];
+            }
+        }
+
+        uint8_t *row = data->buffer + out_y * data->row_step;
+        for (uint32_t x = 0; x < out_width; ++x) {
+            const uint32_t *sum = sums + x * 4;
+            const uint8_t red = sum[0] / sum[3], green = sum[1] / sum[3], blue = sum[2] / sum[3];
+            const uint8_t gray = (uint8_t)(0.3 * red + 0.59 * green + 0.11 * blue);
+            switch (output->type) {
+            case P4:
+                if (x % 8 == 0)
+                    row[x / 8] = 0;
+                if (gray < 128)
+                    row[x / 8] |= 0x80 >> (x % 8); // 1 is black
+                break;
+            case P5:
+            case BMPG:
+                row[x] = gray;
+                break;
+            case BMPP:
+                row[x] = quantizePixel(red, green, blue, x, out_y);
+                break;
+            case P6:
+                row[x * 3 + 0] = red;
+                row[x * 3 + 1] = green;
+                row[x * 3 + 2] = blue;
+                break;
+            case BMP:
+            case BMPC:
+            default:
+                row[x * 3 + 0] = blue;
+                row[x * 3 + 1] = green;
+                row[x * 3 + 2] = red;
+                break;
+            }
+        }
+    }
+
+    free(sums);
+    return NULL;
+}
+
+// change detection
+void* hashTileRows(void *arg){
+    // start_row has to be a multiple of TILE_HEIGHT, every tile is hashed by one thread
+    ThreadData *data = (ThreadData *)arg;
+    const uint32_t bits_per_pixel = data->info->bits_per_pixel;
+    const uint32_t bytes_per_row = (data->info->xres * bits_per_pixel + 7) / 8;
+    const uint32_t bytes_per_tile = TILE_WIDTH * bits_per_pixel / 8;
+    const uint32_t tiles_x = (data->info->xres + TILE_WIDTH - 1) / TILE_WIDTH;
+
+    for (uint32_t y = data->start_row; y < data->start_row + data->num_rows; ++y) {
+        const uint8_t *current = data->video_memory + (y + data->info->yoffset) * data->line_length +
+                                 data->info->xoffset * bits_per_pixel / 8;
+        uint32_t *hash = data->hashes + (y / TILE_HEIGHT) * tiles_x;
+        if (y % TILE_HEIGHT == 0) {
+            memset(hash, 0, tiles_x * sizeof(*hash));
+        }
+        for (uint32_t x = 0; x < tiles_x; ++x) {
+            const uint32_t offset = x * bytes_per_tile;
+            const uint32_t length = (bytes_per_row - offset < bytes_per_tile) ? bytes_per_row - offset : bytes_per_tile;
+            hash[x] = hashBytes(current + offset, length, hash[x]);
+        }
+    }
+    return NULL;
+}
 
-static inline void dumpVideoMemory(const uint8_t *video_memory, const vsi *info, const cmap *colormap, uint32_t line_length, FILE *fp, int use_multithreading, const FileType imageFileFormat) {
+static inline void setupImageFormat(ImageFormat *format, const vsi *info, const FileType imageFileFormat) {
     // P4, P5, P6, BMP, bmp, BMPC, bmpc, BMPG, bmpg
-    const uint32_t bytes_per_pixel = (info->bits_per_pixel + 7) / 8;
     const uint32_t width = info->xres;
     const uint32_t height = info->yres;
-    uint32_t row_step = 0;
-    uint16_t bit_count = 24;
-    uint32_t image_size;
-    char* format = NULL;
-    ProcessRows processRows;
-    ProcessRowCallback processRowCallback = NULL;
+    const char* netpbm = NULL;
+
+    format->processRowCallback = NULL;
+    format->bit_count = 24;
+    format->header_size = 0;
 
     switch(imageFileFormat){
     // NETPBM
+#if FORMAT_P4
     case P4:
         // Bitmap
-        row_step = (info->xres + 7) / 8;
-        processRows = processPbmRows;
-        format = "P4";
-        fprintf(fp, "%s %" PRIu32 " %" PRIu32 " 255\n", format, info->xres, info->yres);
+        format->row_step = (info->xres + 7) / 8;
+        format->processRows = processPbmRows;
+        netpbm = "P4";
         break;
+#endif
+#if FORMAT_P5
     case P5:
         // Grayscale
-        row_step = info->xres;
-        processRows = processPgmRows;
-        format = "P5";
-        fprintf(fp, "%s %" PRIu32 " %" PRIu32 " 255\n", format, info->xres, info->yres);
+        format->row_step = info->xres;
+        format->processRows = processPgmRows;
+        netpbm = "P5";
         break;
+#endif
+#if FORMAT_P6
     case P6:
         // Colored
-        row_step = info->xres * 3;
-        processRows = processPpmRows;
-        format = "P6";
-        fprintf(fp, "%s %" PRIu32 " %" PRIu32 " 255\n", format, info->xres, info->yres);
+        format->row_step = info->xres * 3;
+        format->processRows = processPpmRows;
+        netpbm = "P6";
         break;
+#endif
     // BMP
+#if FORMAT_BMPG
     case BMPG:
         // Grayscale
-        row_step = (width + 3) & (~3);
-        bit_count = 8;
-        processRows = processBmpGrayscaleRows;
-        image_size = row_step * height;
-        writeBmpHeader(image_size, width, height, bit_count, fp);
+        format->row_step = (width + 3) & (~3);
+        format->bit_count = 8;
+        format->processRows = (pixelBits(info) == 1) ? processMonoBmpRows : processBmpGrayscaleRows;
         break;
+#endif
+#if FORMAT_BMPC
     case BMP:
     case BMPC:
         // Colored
-        row_step = (width * 3 + 3) & (~3); // 3 bytes per pixel (RGB)
-        bit_count = 24;
-        processRows = processBmpColoredRows;
-        processRowCallback = processBmpColoredRow;
-        image_size = row_step * height;
-        writeBmpHeader(image_size, width, height, bit_count, fp);
+        format->row_step = (width * 3 + 3) & (~3); // 3 bytes per pixel (RGB)
+        format->bit_count = 24;
+        format->processRows = (pixelBits(info) == 1) ? processMonoBmpRows : processBmpColoredRows;
+        format->processRowCallback = processBmpColoredRow;
+        break;
+#endif
+#if FORMAT_BMPP
+    case BMPP:
+        // Palette
+        format->row_step = (width + 3) & (~3);
+        format->bit_count = 8;
+        format->processRows = processIndexedRows;
         break;
+#endif
     default:
         // No one knows
-        row_step = 0;
-        processRows = NULL;
-        processRowCallback = NULL;
+        format->row_step = 0;
+        format->processRows = NULL;
         notSupported("File format not supported");
         break;
     }
 
-    image_size = height * row_step;
-    uint8_t *buffer = (uint8_t *)malloc(image_size);
-    if (buffer == NULL) {
-        posixError("malloc failed");
+    format->image_size = height * format->row_step;
+    if (netpbm) {
+        // P4 has no maxval
+        format->header_size = snprintf((char *)format->header, MAX_HEADER_SIZE, "%s %" PRIu32 " %" PRIu32 "%s\n",
+                                       netpbm, info->xres, info->yres, imageFileFormat == P4 ? "" : " 255");
+    } else {
+        uint8_t colors[256][3];
+        paletteColors(colors);
+        format->header_size = makeBmpHeader(format->header, format->image_size, width, height, format->bit_count,
+                                            imageFileFormat == BMPP ? (const uint8_t (*)[3])colors : NULL);
     }
+}
 
-    ThreadData data = {
-        .video_memory = video_memory,
-        .info = info,
-        .colormap = colormap,
-        .line_length = line_length,
-        .buffer = buffer,
-        .bytes_per_pixel = bytes_per_pixel,
-        .row_step = row_step,
-        .bit_count = bit_count,
-        .processRowCallback = processRowCallback
-        // .start_row = 0,
-        // .num_rows = info->yres
-    };
-
-    if (use_multithreading) {
-        // Get the number of available processors at runtime
-        uint32_t num_threads = sysconf(_SC_NPROCESSORS_ONLN);
-        num_threads = num_threads > 0 ? num_threads : 1;
-
-        // Initialize the linked list for threads
-        ThreadNode *head = NULL, *tail = NULL;
-        const uint32_t rows_per_thread = height / num_threads;
-        const uint32_t remaining_rows = height % num_threads;
-
-        for (uint32_t i = 0; i < num_threads; ++i) {
-            ThreadNode *node = (ThreadNode *)malloc(sizeof(ThreadNode));
-            if (!node) {
-                posixError("malloc failed for ThreadNode");
-            }
+void* processBudgetedRows(void *arg){
+    // Runs budgetedRows band by band. After every band the thread sleeps until its CPU time is
+    // at most budget percent of the wall time since it started.
+    ThreadData *data = (ThreadData *)arg;
+    ThreadData band = *data;
+    const double started = nowMs();
+    const double cpu_started = cpuMs(CLOCK_THREAD_CPUTIME_ID);
+
+    for (uint32_t row = data->start_row; row < data->start_row + data->num_rows; row += data->budget_band) {
+        band.start_row = row;
+        band.num_rows = (data->start_row + data->num_rows - row < data->budget_band) ?
+                            data->start_row + data->num_rows - row : data->budget_band;
+        data->budgetedRows(&band);
+
+        const double due = (cpuMs(CLOCK_THREAD_CPUTIME_ID) - cpu_started) * 100.0 / data->budget;
+        const double ahead = due - (nowMs() - started);
+        if (ahead > 0) {
+            const struct timespec wait = { (time_t)(ahead / 1000), (long)(ahead * 1000000) % 1000000000L };
+            nanosleep(&wait, NULL);
+        }
+    }
+    return NULL;
+}
 
-            data.num_rows = rows_per_thread;
-            data.start_row = i * rows_per_thread;
-            node->data = data;
+void* processBandedRows(void *arg){
+    // every thread takes the next band until none is left, so uneven rows don't leave threads idle
+    ThreadData *data = (ThreadData *)arg;
+    ThreadData band = *data;
+    for (;;) {
+        const uint32_t row = atomic_fetch_add_explicit(data->next_row, data->work_band, memory_order_relaxed);
+        if (row >= data->end_row)
+            break;
+        band.start_row = row;
+        band.num_rows = (data->end_row - row < data->work_band) ? data->end_row - row : data->work_band;
+        data->bandedRows(&band);
+    }
+    return NULL;
+}
 
-            if (i == num_threads - 1) {
-                node->data.num_rows += remaining_rows; // Add remaining rows to the last thread
-            }
-            node->next = NULL;
+static inline void runRows(const ThreadData *data, ProcessRows processRows, uint32_t start_row, uint32_t num_rows,
+                           uint32_t num_threads, uint32_t row_granularity) {
+    // Splits [start_row, start_row + num_rows) into num_threads parts. Every part except the last
+    // one is a multiple of row_granularity rows long.
+    ThreadData budgeted;
+    if (cpu_budget) {
+        // the threads share the budget
+        budgeted = *data;
+        budgeted.budgetedRows = processRows;
+        budgeted.budget_band = (BUDGET_BAND_ROWS + row_granularity - 1) / row_granularity * row_granularity;
+        budgeted.budget = (double)cpu_budget / (num_threads > 1 ? num_threads : 1);
+        data = &budgeted;
+        processRows = processBudgetedRows;
+    }
+    if (num_threads <= 1 || num_rows <= row_granularity) {
+        ThreadData serial = *data;
+        serial.start_row = start_row;
+        serial.num_rows = num_rows;
+        processRows(&serial);
+        return;
+    }
 
-            if (tail) {
-                tail->next = node;
-            } else {
-                head = node;
-            }
-            tail = node;
+    // Initialize the linked list for threads
+    ThreadNode *head = NULL, *tail = NULL;
+    const uint32_t units = (num_rows + row_granularity - 1) / row_granularity;
+    const uint32_t units_per_thread = (units + num_threads - 1) / num_threads;
+    uint32_t rows_per_thread = units_per_thread * row_granularity;
+    atomic_uint next_row = start_row;
+    ThreadData banded;
+    if (work_band_rows && !cpu_budget) {
+        // num_threads threads share the bands, see processBandedRows
+        banded = *data;
+        banded.bandedRows = processRows;
+        banded.work_band = (work_band_rows + row_granularity - 1) / row_granularity * row_granularity;
+        banded.end_row = start_row + num_rows;
+        banded.next_row = &next_row;
+        data = &banded;
+        processRows = processBandedRows;
+        rows_per_thread = (num_rows + num_threads - 1) / num_threads;
+    }
 
-            pthread_create(&node->thread, NULL, processRows, &node->data);
+    for (uint32_t row = start_row; row < start_row + num_rows; row += rows_per_thread) {
+        ThreadNode *node = (ThreadNode *)malloc(sizeof(ThreadNode));
+        if (!node) {
+            posixError("malloc failed for ThreadNode");
         }
 
-        // Join all threads
-        ThreadNode *current = head;
-        while (current) {
-            pthread_join(current->thread, NULL);
-            ThreadNode *next = current->next;
-            free(current);
-            current = next;
+        node->data = *data;
+        node->data.start_row = row;
+        node->data.num_rows = (start_row + num_rows - row < rows_per_thread) ? start_row + num_rows - row : rows_per_thread;
+        node->next = NULL;
+
+        if (tail) {
+            tail->next = node;
+        } else {
+            head = node;
         }
-    } else {
-        // Prepare thread data for the entire image
-        data.num_rows = height;
-        data.start_row = 0;
+        tail = node;
 
-        // Process all rows serially
-        processRows(&data);
+        pthread_create(&node->thread, NULL, processRows, &node->data);
     }
 
-    if (fwrite(buffer, image_size, 1, fp) != 1) {
-        posixError("write error");
+    // Join all threads
+    ThreadNode *current = head;
+    while (current) {
+        pthread_join(current->thread, NULL);
+        ThreadNode *next = current->next;
+        free(current);
+        current = next;
     }
-
-    free(buffer);
 }
 
+static inline void writeFully(int fd, const uint8_t *data, size_t size, off_t offset) {
+    while (size) {
+        const ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            posixError("write error");
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
 
+static inline bool isOutputFile(FILE *fp) {
+    // regular files at offset 0 can be written in place, anything else is a stream
+    struct stat output_stat;
+    return fstat(fileno(fp), &output_stat) == 0 && S_ISREG(output_stat.st_mode) &&
+           lseek(fileno(fp), 0, SEEK_CUR) == 0;
+}
+static inline uint8_t *mapOutputFile(FILE *fp, const ImageFormat *format) {
+    // Sizes the output file and maps it, so that workers convert straight into the page cache.
+    // Returns NULL if the file can not be mapped, the header is written anyway.
+    const int fd = fileno(fp);
+    const size_t size = format->header_size + format->image_size;
+
+    fflush(fp);
+    if (ftruncate(fd, size)) {
+        posixError("ftruncate failed");
+    }
+    // reserve the blocks up front, a full disk would be a SIGBUS in the middle of the conversion
+    const int result = posix_fallocate(fd, 0, size);
+    if (result == ENOSPC || result == EFBIG) {
+        errno = result;
+        posixError("fallocate failed");
+    }
 
+    uint8_t *map = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        writeFully(fd, format->header, format->header_size, 0);
+        return NULL;
+    }
+    memcpy(map, format->header, format->header_size);
+    return map;
+}
+void* convertAndWriteRows(void *arg){
+    // fallback of mapOutputFile: every thread writes its own rows at their final offset
+    ThreadData *data = (ThreadData *)arg;
+    data->processRows(arg);
+    writeFully(data->fd, data->buffer + data->start_row * data->row_step, data->num_rows * data->row_step,
+               data->file_offset + data->start_row * data->row_step);
+    return NULL;
+}
 
-
-
-
-int main(int argc, char **argv){
+static inline bool isPipe(FILE *fp) {
+    struct stat output_stat;
+    return fstat(fileno(fp), &output_stat) == 0 && S_ISFIFO(output_stat.st_mode);
+}
+static inline uint32_t preparePipe(int fd, const ImageFormat *format) {
+    // Grows the pipe to hold a whole frame. Returns how many frame buffers have to rotate so that
+    // a buffer is rewritten only after the reader consumed the pages spliced from it.
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t frame_pages = 1 + (format->image_size + page_size - 1) / page_size; // header page + image
+    size_t wanted = frame_pages * page_size;
+    unsigned long max_size;
+    FILE *max_file = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (max_file) {
+        if (fscanf(max_file, "%lu", &max_size) == 1 && wanted > max_size)
+            wanted = max_size;
+        fclose(max_file);
+    }
+    // deliberately ignore errors, the pipe just stays smaller
+    (void)fcntl(fd, F_SETPIPE_SZ, (int)wanted);
+
+    int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+    if (pipe_size <= 0)
+        pipe_size = 16 * page_size;
+    const size_t pipe_pages = pipe_size / page_size;
+    return (pipe_pages + frame_pages - 1) / frame_pages + 1;
+}
+static inline uint8_t *allocFrameBuffer(const ImageFormat *format) {
+    // Page aligned image with the header right in front of it. Header and image go out in one
+    // write and the image pages can be handed to vmsplice.
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    uint8_t *base = (uint8_t *)mmap(NULL, page_size + format->image_size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        posixError("mmap failed");
+    }
+    memcpy(base + page_size - format->header_size, format->header, format->header_size);
+    return base + page_size;
+}
+static inline void freeFrameBuffer(uint8_t *buffer, const ImageFormat *format) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    munmap(buffer - page_size, page_size + format->image_size);
+}
+static inline void writeFrame(FILE *fp, const uint8_t *frame, size_t size) {
+    // Pipes get the pages with vmsplice, no copy into the pipe. Everything else goes through stdio.
+    if (!isPipe(fp)) {
+        if (fwrite(frame, size, 1, fp) != 1) {
+            posixError("write error");
+        }
+        fflush(fp);
+        return;
+    }
+
+    fflush(fp);
+    while (size) {
+        ssize_t written;
+        if (!vmsplice_failed) {
+            struct iovec iov = { (void *)frame, size };
+            written = vmsplice(fileno(fp), &iov, 1, 0);
+            if (written < 0 && (errno == EINVAL || errno == ENOSYS || errno == EBADF)) {
+                vmsplice_failed = true;
+                continue;
+            }
+        } else {
+            written = write(fileno(fp), frame, size);
+        }
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            posixError("write error");
+        }
+        frame += written;
+        size -= written;
+    }
+}
+
+static inline void reportChanges(const FrameHistory *history, const vsi *info, uint32_t dirty_tiles, double hash_ms) {
+    // Dirty tiles of a band are merged into horizontal runs, runs with the same
+    // columns in consecutive bands are merged into one rectangle.
+    typedef struct { uint32_t x, y, w, h; } Rect;
+    Rect *rects = (Rect *)malloc(history->tiles_x * history->tiles_y * sizeof(Rect));
+    uint32_t num_rects = 0;
+    if (rects == NULL) {
+        posixError("malloc failed");
+    }
+
+    for (uint32_t ty = 0; ty < history->tiles_y; ++ty) {
+        const uint8_t *dirty = history->dirty_tiles + ty * history->tiles_x;
+        for (uint32_t tx = 0; tx < history->tiles_x; ++tx) {
+            if (!dirty[tx])
+                continue;
+            uint32_t end = tx;
+            while (end < history->tiles_x && dirty[end])
+                ++end;
+
+            Rect rect = {
+                .x = tx * TILE_WIDTH,
+                .y = ty * TILE_HEIGHT,
+                .w = ((end * TILE_WIDTH < info->xres) ? end * TILE_WIDTH : info->xres) - tx * TILE_WIDTH,
+                .h = ((ty * TILE_HEIGHT + TILE_HEIGHT < info->yres) ? TILE_HEIGHT : info->yres - ty * TILE_HEIGHT)
+            };
+            uint32_t i;
+            for (i = 0; i < num_rects; ++i) {
+                if (rects[i].x == rect.x && rects[i].w == rect.w && rects[i].y + rects[i].h == rect.y) {
+                    rects[i].h += rect.h;
+                    break;
+                }
+            }
+            if (i == num_rects) {
+                rects[num_rects++] = rect;
+            }
+            tx = end;
+        }
+    }
+
+    fprintf(history->stats, "{\"frame\":%" PRIu64 ",\"changed\":%s,\"dirty_tiles\":%" PRIu32 ",\"tiles\":%" PRIu32
+            ",\"hash_ms\":%.3f,\"rects\":[",
+            history->frame, dirty_tiles ? "true" : "false", dirty_tiles,
+            history->tiles_x * history->tiles_y, hash_ms);
+    for (uint32_t i = 0; i < num_rects; ++i) {
+        fprintf(history->stats, "%s[%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 "]",
+                i ? "," : "", rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+    }
+    fprintf(history->stats, "]}\n");
+    fflush(history->stats);
+    free(rects);
+}
+static inline void reportGifChanges(const FrameHistory *history, const vsi *info) {
+    // Same line as reportChanges. The rectangle is the changed sub-rectangle of the palette frame,
+    // dirty_tiles the tiles it covers.
+    const GifWriter *gif = &history->gif;
+    const uint32_t tiles_x = (info->xres + TILE_WIDTH - 1) / TILE_WIDTH;
+    const uint32_t tiles_y = (info->yres + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    const uint32_t dirty_tiles = gif->changed ?
+        ((gif->right + TILE_WIDTH - 1) / TILE_WIDTH - gif->left / TILE_WIDTH) *
+        ((gif->bottom + TILE_HEIGHT - 1) / TILE_HEIGHT - gif->top / TILE_HEIGHT) : 0;
+
+    fprintf(history->stats, "{\"frame\":%" PRIu64 ",\"changed\":%s,\"dirty_tiles\":%" PRIu32 ",\"tiles\":%" PRIu32
+            ",\"hash_ms\":%.3f,\"rects\":[",
+            history->frame, gif->changed ? "true" : "false", dirty_tiles, tiles_x * tiles_y, gif->compare_ms);
+    if (gif->changed) {
+        fprintf(history->stats, "[%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 "]",
+                gif->left, gif->top, gif->right - gif->left, gif->bottom - gif->top);
+    }
+    fprintf(history->stats, "]}\n");
+    fflush(history->stats);
+}
+
+// gif
+static inline void putLe16(uint16_t value, FILE *fp) {
+    fputc(value & 0xFF, fp);
+    fputc(value >> 8, fp);
+}
+static inline void flushGifBlock(GifBits *bits) {
+    if (bits->block_size) {
+        fputc(bits->block_size, bits->fp);
+        fwrite(bits->block, bits->block_size, 1, bits->fp);
+        bits->block_size = 0;
+    }
+}
+static inline void putGifCode(GifBits *bits, uint32_t code, uint32_t code_size) {
+    // codes are packed lowest bit first into sub-blocks of at most 255 bytes
+    bits->buffer |= code << bits->count;
+    bits->count += code_size;
+    while (bits->count >= 8) {
+        bits->block[bits->block_size++] = bits->buffer & 0xFF;
+        bits->buffer >>= 8;
+        bits->count -= 8;
+        if (bits->block_size == sizeof(bits->block))
+            flushGifBlock(bits);
+    }
+}
+static inline void encodeGifImage(FILE *fp, const uint8_t *indices, uint32_t stride,
+                                  uint32_t left, uint32_t top, uint32_t width, uint32_t height) {
+    // LZW, 8 bit minimum code size, codes grow up to 12 bits. The dictionary is a hash table of
+    // (prefix code, next index) pairs, cleared whenever all 4096 codes are used.
+    int32_t keys[GIF_HASH_SIZE];
+    uint16_t codes[GIF_HASH_SIZE];
+    GifBits bits = { .fp = fp };
+    uint32_t code_size = 9, max_code = GIF_EOI;
+    int32_t prefix = -1;
+
+    memset(keys, 0xFF, sizeof(keys));
+    fputc(8, fp);
+    putGifCode(&bits, GIF_CLEAR, code_size);
+
+    for (uint32_t y = top; y < top + height; ++y) {
+        const uint8_t *row = indices + y * stride;
+        for (uint32_t x = left; x < left + width; ++x) {
+            const int32_t index = row[x];
+            if (prefix < 0) {
+                prefix = index;
+                continue;
+            }
+
+            const int32_t key = (prefix << 8) | index;
+            uint32_t hash = (uint32_t)((index << 12) ^ prefix) % GIF_HASH_SIZE;
+            while (keys[hash] != -1 && keys[hash] != key)
+                hash = (hash + 1) % GIF_HASH_SIZE;
+            if (keys[hash] == key) {
+                prefix = codes[hash];
+                continue;
+            }
+
+            putGifCode(&bits, prefix, code_size);
+            keys[hash] = key;
+            codes[hash] = ++max_code;
+            if (max_code >= (1U << code_size))
+                ++code_size;
+            if (max_code == GIF_MAX_CODE) {
+                putGifCode(&bits, GIF_CLEAR, code_size);
+                memset(keys, 0xFF, sizeof(keys));
+                code_size = 9;
+                max_code = GIF_EOI;
+            }
+            prefix = index;
+        }
+    }
+
+    putGifCode(&bits, prefix, code_size);
+    putGifCode(&bits, GIF_EOI, code_size);
+    if (bits.count) {
+        putGifCode(&bits, 0, 8 - bits.count);
+    }
+    flushGifBlock(&bits);
+    fputc(0, fp); // block terminator
+}
+static inline void writeGifFrame(GifWriter *gif, FILE *fp, uint16_t delay) {
+    // graphic control extension: leave the previous frame in place, only the sub-rectangle changes
+    const uint8_t control[] = { 0x21, 0xF9, 0x04, 0x04 };
+    fwrite(control, sizeof(control), 1, fp);
+    putLe16(delay, fp);
+    fputc(0, fp); // no transparent color
+    fputc(0, fp);
+
+    fputc(0x2C, fp); // image descriptor
+    putLe16(gif->left, fp);
+    putLe16(gif->top, fp);
+    putLe16(gif->right - gif->left, fp);
+    putLe16(gif->bottom - gif->top, fp);
+    fputc(0, fp); // global color table, not interlaced
+    encodeGifImage(fp, gif->pending, gif->width, gif->left, gif->top, gif->right - gif->left, gif->bottom - gif->top);
+}
+static inline uint16_t gifDelay(double ms) {
+    // 1/100 s, most viewers replace delays below 2 with 10
+    const double delay = ms / 10.0 + 0.5;
+    return delay < 2 ? 2 : delay > 65535 ? 65535 : (uint16_t)delay;
+}
+static inline void finishGif(GifWriter *gif, FILE *fp) {
+    // writes the last frame and the trailer
+    if (!FORMAT_GIF || !gif->started)
+        return;
+    writeGifFrame(gif, fp, gif->animated ? gifDelay(gif->last_interval) : 0);
+    fputc(0x3B, fp);
+    fflush(fp);
+
+    struct stat output_stat;
+    if (fstat(fileno(fp), &output_stat) == 0 && S_ISREG(output_stat.st_mode) &&
+        ftruncate(fileno(fp), ftello(fp))) {
+        posixError("ftruncate failed");
+    }
+    if (ferror(fp)) {
+        posixError("write error");
+    }
+    gif->started = false;
+}
+
+static inline void dumpGif(const uint8_t *video_memory, const vsi *info, const cmap *colormap, uint32_t line_length,
+                           FILE *fp, uint32_t num_threads, GifWriter *gif, double timestamp) {
+    // gif is NULL for a single frame image. A frame is written when the next one arrives,
+    // that is when its delay is known.
+    GifWriter single = {0};
+    GifWriter *writer = gif ? gif : &single;
+    const uint32_t width = info->xres;
+    const uint32_t height = info->yres;
+
+    if (writer->current == NULL) {
+        writer->width = width;
+        writer->height = height;
+        writer->animated = gif != NULL;
+        writer->current = (uint8_t *)malloc(width * height);
+        writer->pending = (uint8_t *)malloc(width * height);
+        if (writer->current == NULL || writer->pending == NULL) {
+            posixError("malloc failed");
+        }
+    }
+
+    // quantization runs on all threads
+    ThreadData data = {
+        .video_memory = video_memory,
+        .info = info,
+        .colormap = colormap,
+        .line_length = line_length,
+        .buffer = writer->current,
+        .bytes_per_pixel = (info->bits_per_pixel + 7) / 8,
+        .row_step = width
+    };
+    runRows(&data, processIndexedRows, 0, height, num_threads, 1);
+
+    uint32_t left = 0, top = 0, right = width, bottom = height;
+    bool changed = true;
+    const double compare_start = nowMs();
+    if (writer->started) {
+        // bounding box of the pixels that changed since the pending frame
+        left = width;
+        right = bottom = 0;
+        top = height;
+        for (uint32_t y = 0; y < height; ++y) {
+            const uint8_t *current = writer->current + y * width;
+            const uint8_t *pending = writer->pending + y * width;
+            if (memcmp(current, pending, width) == 0)
+                continue;
+            uint32_t first = 0, last = width;
+            while (current[first] == pending[first])
+                ++first;
+            while (current[last - 1] == pending[last - 1])
+                --last;
+            if (first < left)
+                left = first;
+            if (last > right)
+                right = last;
+            if (y < top)
+                top = y;
+            bottom = y + 1;
+        }
+        if (right == 0) {
+            // nothing changed, a single pixel keeps the timing
+            changed = false;
+            left = top = 0;
+            right = bottom = 1;
+        }
+        writer->compare_ms = nowMs() - compare_start;
+
+        writer->last_interval = timestamp - writer->timestamp;
+        writeGifFrame(writer, fp, gifDelay(writer->last_interval));
+    } else {
+        uint8_t colors[256][3];
+        paletteColors(colors);
+        fwrite("GIF89a", 6, 1, fp);
+        putLe16(width, fp);
+        putLe16(height, fp);
+        fputc(0xF7, fp); // global color table of 256 colors
+        fputc(0, fp); // background
+        fputc(0, fp); // aspect ratio
+        fwrite(colors, sizeof(colors), 1, fp);
+        if (writer->animated) {
+            const uint8_t loop[] = { 0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00 };
+            fwrite(loop, sizeof(loop), 1, fp);
+        }
+        writer->started = true;
+    }
+
+    uint8_t *swap = writer->pending;
+    writer->pending = writer->current;
+    writer->current = swap;
+    writer->left = left;
+    writer->top = top;
+    writer->right = right;
+    writer->bottom = bottom;
+    writer->changed = changed;
+    writer->timestamp = timestamp;
+
+    if (gif == NULL) {
+        finishGif(writer, fp);
+        free(writer->current);
+        free(writer->pending);
+    }
+}
+
+static inline void dumpChangedVideoMemory(const ThreadData *data, const ImageFormat *format, const vsi *info,
+                                          FILE *fp, uint32_t num_threads, FrameHistory *history) {
+    const uint32_t height = info->yres;
+    const uint32_t num_tiles = history->tiles_x * history->tiles_y;
+    ThreadData hash_data = *data;
+    uint32_t dirty_tiles = 0;
+
+    // hash the raw framebuffer tiles
+    const double hash_start = nowMs();
+    hash_data.hashes = history->next_hashes;
+    runRows(&hash_data, hashTileRows, 0, height, num_threads, TILE_HEIGHT);
+
+    for (uint32_t i = 0; i < num_tiles; ++i) {
+        history->dirty_tiles[i] = !history->valid || history->hashes[i] != history->next_hashes[i];
+        if (history->dirty_tiles[i]) {
+            history->band_changes[i / history->tiles_x] = history->frame;
+            ++dirty_tiles;
+        }
+    }
+    uint32_t *swap = history->hashes;
+    history->hashes = history->next_hashes;
+    history->next_hashes = swap;
+    history->valid = true;
+
+    if (history->stats) {
+        reportChanges(history, info, dirty_tiles, nowMs() - hash_start);
+    }
+    if (!dirty_tiles && !history->write_unchanged) {
+        ++history->frame;
+        return;
+    }
+
+    // convert only the row bands which changed since the slot was written
+    FrameSlot *slot = &history->slots[history->next_slot];
+    history->next_slot = (history->next_slot + 1) % history->num_slots;
+    ThreadData slot_data = *data;
+    slot_data.buffer = slot->buffer;
+    for (uint32_t band = 0; band < history->tiles_y; ++band) {
+        history->dirty_bands[band] = !slot->valid || history->band_changes[band] > slot->frame;
+    }
+
+    for (uint32_t band = 0; band < history->tiles_y; ++band) {
+        if (!history->dirty_bands[band])
+            continue;
+        uint32_t end = band;
+        while (end < history->tiles_y && history->dirty_bands[end])
+            ++end;
+
+        const uint32_t start_row = band * TILE_HEIGHT;
+        const uint32_t num_rows = ((end * TILE_HEIGHT < height) ? end * TILE_HEIGHT : height) - start_row;
+        if (history->in_place && !history->map) {
+            // update the dirty rows of the output file in place
+            runRows(&slot_data, convertAndWriteRows, start_row, num_rows, num_threads, 1);
+        } else {
+            runRows(&slot_data, format->processRows, start_row, num_rows, num_threads, 1);
+        }
+        band = end;
+    }
+
+    if (!history->in_place) {
+        // streams get the whole frame
+        writeFrame(fp, slot->buffer - format->header_size, format->header_size + format->image_size);
+    }
+    slot->frame = history->frame;
+    slot->valid = true;
+    ++history->frame;
+}
+
+static inline void dumpVideoMemory(const uint8_t *video_memory, const vsi *info, const cmap *colormap, uint32_t line_length, FILE *fp, uint32_t num_threads, const FileType imageFileFormat, FrameHistory *history) {
+    // history is NULL for a single capture
+    const uint32_t bytes_per_pixel = (info->bits_per_pixel + 7) / 8;
+    const uint32_t height = info->yres;
+    const bool in_place = (history && history->slots) ? history->in_place : isOutputFile(fp);
+    ImageFormat format;
+    uint8_t *buffer, *map = NULL;
+
+    if (FORMAT_GIF && imageFileFormat == GIF) {
+        dumpGif(video_memory, info, colormap, line_length, fp, num_threads, history ? &history->gif : NULL, nowMs());
+        if (history) {
+            if (history->stats) {
+                reportGifChanges(history, info);
+            }
+            ++history->frame;
+        }
+        return;
+    }
+    setupImageFormat(&format, info, imageFileFormat);
+
+    if (history) {
+        if (history->slots == NULL) {
+            history->tiles_x = (info->xres + TILE_WIDTH - 1) / TILE_WIDTH;
+            history->tiles_y = (height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+            const uint32_t num_tiles = history->tiles_x * history->tiles_y;
+            history->hashes = (uint32_t *)malloc(num_tiles * sizeof(uint32_t));
+            history->next_hashes = (uint32_t *)malloc(num_tiles * sizeof(uint32_t));
+            history->dirty_tiles = (uint8_t *)malloc(num_tiles);
+            history->dirty_bands = (uint8_t *)malloc(history->tiles_y);
+            history->band_changes = (uint64_t *)calloc(history->tiles_y, sizeof(uint64_t));
+            history->num_slots = isPipe(fp) ? preparePipe(fileno(fp), &format) : 1;
+            history->slots = (FrameSlot *)calloc(history->num_slots, sizeof(FrameSlot));
+            if (!history->hashes || !history->next_hashes || !history->dirty_tiles || !history->dirty_bands ||
+                !history->band_changes || !history->slots) {
+                posixError("malloc failed");
+            }
+            if ((history->in_place = in_place)) {
+                // the mapped output file is the retained buffer
+                history->map = mapOutputFile(fp, &format);
+                history->map_size = format.header_size + format.image_size;
+            }
+            if (history->map) {
+                history->slots[0].buffer = history->map + format.header_size;
+            } else {
+                for (uint32_t i = 0; i < history->num_slots; ++i) {
+                    history->slots[i].buffer = allocFrameBuffer(&format);
+                }
+            }
+        }
+        buffer = history->slots[0].buffer;
+    } else if (in_place && (map = mapOutputFile(fp, &format)) != NULL) {
+        buffer = map + format.header_size;
+    } else {
+        if (isPipe(fp)) {
+            preparePipe(fileno(fp), &format);
+        }
+        buffer = allocFrameBuffer(&format);
+    }
+
+    ThreadData data = {
+        .video_memory = video_memory,
+        .info = info,
+        .colormap = colormap,
+        .line_length = line_length,
+        .buffer = buffer,
+        .bytes_per_pixel = bytes_per_pixel,
+        .row_step = format.row_step,
+        .bit_count = format.bit_count,
+        .processRowCallback = format.processRowCallback,
+        .processRows = format.processRows,
+        .fd = fileno(fp),
+        .file_offset = format.header_size
+        // .start_row = 0,
+        // .num_rows = info->yres
+    };
+
+    if (history) {
+        dumpChangedVideoMemory(&data, &format, info, fp, num_threads, history);
+        return;
+    }
+
+    if (map) {
+        // converted straight into the output file
+        runRows(&data, format.processRows, 0, height, num_threads, 1);
+        munmap(map, format.header_size + format.image_size);
+        return;
+    }
+    if (in_place) {
+        // output file that can't be mapped
+        runRows(&data, convertAndWriteRows, 0, height, num_threads, 1);
+    } else {
+        runRows(&data, format.processRows, 0, height, num_threads, 1);
+        writeFrame(fp, buffer - format.header_size, format.header_size + format.image_size);
+    }
+
+    // a pipe keeps its own references to the spliced pages
+    freeFrameBuffer(buffer, &format);
+}
+
+// probe
+void* probeRows(void *arg){
+    // Integer luma of all rows with processLumaRows, 1 bpp rows through the PBM kernel on a scratch row.
+    // Statistics are merged under probe->lock
+    ThreadData *data = (ThreadData *)arg;
+    Probe *probe = data->probe;
+    const uint32_t width = data->info->xres;
+    const uint32_t height = data->info->yres;
+    const uint32_t bits_per_pixel = data->info->bits_per_pixel;
+    uint64_t luma_sum = 0, near_black = 0;
+    uint64_t histogram[256] = {0};
+    uint64_t phash_sums[PHASH_SIZE * PHASH_SIZE] = {0};
+    uint8_t *grays = (uint8_t *)malloc((size_t)width * data->num_rows);
+    uint8_t *packed = (uint8_t *)malloc((width + 7) / 8);
+    if (grays == NULL || packed == NULL) {
+        posixError("malloc failed");
+    }
+
+    // all rows of this thread at once, the luma kernel sets up its tables only once
+    ThreadData rows_data = *data;
+    rows_data.buffer = grays;
+    rows_data.row_step = width;
+    if (bits_per_pixel != 1) {
+        processLumaRows(&rows_data);
+    }
+
+    ThreadData row_data = *data;
+    row_data.buffer = packed;
+    row_data.row_step = 0; // every row lands on the scratch row
+    row_data.num_rows = 1;
+
+    for (uint32_t y = data->start_row; y < data->start_row + data->num_rows; ++y) {
+        uint8_t *gray = grays + (size_t)(y - data->start_row) * width;
+        if (bits_per_pixel == 1) {
+            row_data.start_row = y;
+            processPbmRows(&row_data);
+            // P4: 1 is black
+            for (uint32_t x = 0; x < width; ++x) {
+                gray[x] = ((packed[x / 8] >> (7 - x % 8)) & 1) ? 0 : 255;
+            }
+        }
+
+        for (uint32_t x = 0; x < width; ++x) {
+            luma_sum += gray[x];
+            ++histogram[gray[x]];
+        }
+        if (probe->phash) {
+            uint64_t *block = phash_sums + (uint64_t)y * PHASH_SIZE / height * PHASH_SIZE;
+            for (uint32_t bx = 0; bx < PHASH_SIZE; ++bx) {
+                for (uint32_t x = bx * width / PHASH_SIZE; x < (bx + 1) * width / PHASH_SIZE; ++x) {
+                    block[bx] += gray[x];
+                }
+            }
+        }
+
+        const uint8_t *current = data->video_memory + (y + data->info->yoffset) * data->line_length +
+                                 data->info->xoffset * bits_per_pixel / 8;
+        uint32_t *hash = probe->segment_hashes + y * probe->regions_x;
+        for (uint32_t rx = 0; rx < probe->regions_x; ++rx) {
+            const uint32_t begin = rx * width / probe->regions_x * bits_per_pixel / 8;
+            const uint32_t end = ((rx + 1) * width / probe->regions_x * bits_per_pixel + 7) / 8;
+            hash[rx] = hashBytes(current + begin, end - begin, 0);
+        }
+    }
+    for (uint32_t i = 0; i < PROBE_NEAR_BLACK; ++i) {
+        near_black += histogram[i];
+    }
+
+    pthread_mutex_lock(&probe->lock);
+    probe->luma_sum += luma_sum;
+    probe->near_black += near_black;
+    for (uint32_t i = 0; i < 256; ++i) {
+        probe->histogram[i] += histogram[i];
+    }
+    for (uint32_t i = 0; i < PHASH_SIZE * PHASH_SIZE; ++i) {
+        probe->phash_sums[i] += phash_sums[i];
+    }
+    pthread_mutex_unlock(&probe->lock);
+
+    free(packed);
+    free(grays);
+    return NULL;
+}
+
+static inline void probeVideoMemory(const uint8_t *video_memory, const vsi *info, const cmap *colormap, uint32_t line_length, FILE *fp, uint32_t num_threads, Probe *probe) {
+    const uint32_t width = info->xres;
+    const uint32_t height = info->yres;
+    const uint64_t num_pixels = (uint64_t)width * height;
+    const double start = nowMs();
+
+    if (probe->segment_hashes == NULL) {
+        probe->segment_hashes = (uint32_t *)malloc(height * probe->regions_x * sizeof(uint32_t));
+        if (probe->segment_hashes == NULL) {
+            posixError("malloc failed");
+        }
+    }
+    probe->luma_sum = probe->near_black = 0;
+    memset(probe->histogram, 0, sizeof(probe->histogram));
+    memset(probe->phash_sums, 0, sizeof(probe->phash_sums));
+
+    ThreadData data = {
+        .video_memory = video_memory,
+        .info = info,
+        .colormap = colormap,
+        .line_length = line_length,
+        .bytes_per_pixel = (info->bits_per_pixel + 7) / 8,
+        .probe = probe
+    };
+    runRows(&data, probeRows, 0, height, num_threads, 1);
+
+    const double mean_luma = (double)probe->luma_sum / num_pixels;
+    fprintf(fp, "{\"width\":%" PRIu32 ",\"height\":%" PRIu32 ",\"mean_luma\":%.2f,\"near_black\":%.4f,\"hash\":\"%08" PRIx32 "\"",
+            width, height, mean_luma, (double)probe->near_black / num_pixels,
+            hashBytes((const uint8_t *)probe->segment_hashes, height * probe->regions_x * sizeof(uint32_t), 0));
+
+    // region hashes fold the row segment hashes of every region, row-major
+    fprintf(fp, ",\"regions\":\"%" PRIu32 "x%" PRIu32 "\",\"region_hashes\":[", probe->regions_x, probe->regions_y);
+    for (uint32_t ry = 0; ry < probe->regions_y; ++ry) {
+        for (uint32_t rx = 0; rx < probe->regions_x; ++rx) {
+            uint32_t hash = 0;
+            for (uint32_t y = ry * height / probe->regions_y; y < (ry + 1) * height / probe->regions_y; ++y) {
+                hash = hashBytes((const uint8_t *)&probe->segment_hashes[y * probe->regions_x + rx], sizeof(uint32_t), hash);
+            }
+            fprintf(fp, "%s\"%08" PRIx32 "\"", (ry || rx) ? "," : "", hash);
+        }
+    }
+    fprintf(fp, "]");
+
+    if (probe->phash) {
+        // average hash: a bit is set when the block is brighter than the mean of all blocks
+        double block_means[PHASH_SIZE * PHASH_SIZE], mean = 0;
+        uint64_t phash = 0;
+        for (uint32_t i = 0; i < PHASH_SIZE * PHASH_SIZE; ++i) {
+            const uint32_t bx = i % PHASH_SIZE, by = i / PHASH_SIZE;
+            const uint64_t block_pixels =
+                (uint64_t)((bx + 1) * width / PHASH_SIZE - bx * width / PHASH_SIZE) *
+                ((by + 1) * height / PHASH_SIZE - by * height / PHASH_SIZE);
+            block_means[i] = block_pixels ? (double)probe->phash_sums[i] / block_pixels : 0;
+            mean += block_means[i] / (PHASH_SIZE * PHASH_SIZE);
+        }
+        for (uint32_t i = 0; i < PHASH_SIZE * PHASH_SIZE; ++i) {
+            phash = (phash << 1) | (block_means[i] > mean);
+        }
+        fprintf(fp, ",\"phash\":\"%016" PRIx64 "\"", phash);
+    }
+
+    fprintf(fp, ",\"histogram\":[");
+    for (uint32_t i = 0; i < 256; ++i) {
+        fprintf(fp, "%s%" PRIu64, i ? "," : "", probe->histogram[i]);
+    }
+    fprintf(fp, "],\"ms\":%.3f}\n", nowMs() - start);
+    fflush(fp);
+}
+
+// multi-resolution outputs
+static inline bool parseOutput(char *arg, Output *output) {
+    // file[:scale=1/N][:format=pgm]
+    char *option = strstr(arg, ":scale=");
+    char *format = strstr(arg, ":format=");
+
+    output->file_name = arg;
+    output->scale = 1;
+    if (option) {
+        if (sscanf(option, ":scale=1/%" SCNu32, &output->scale) != 1 || output->scale == 0)
+            return false;
+    }
+    if (format) {
+        format += strlen(":format=");
+        const size_t length = strcspn(format, ":");
+        if (!fileTypeFromName(format, length, &output->type))
+            return false;
+        output->has_type = true;
+    } else {
+        const char *extension = strrchr(arg, '.');
+        if (extension && (!option || extension < option)) {
+            ++extension;
+            output->extension_type = fileTypeFromName(extension, strcspn(extension, ":"), &output->type);
+        }
+    }
+
+    if (option)
+        *option = '\0';
+    if (format)
+        *(format - strlen(":format=")) = '\0';
+    return true;
+}
+
+static inline void setupOutput(Output *output, const vsi *info) {
+    const bool is_mono = info->bits_per_pixel == 1;
+    output->info = *info;
+    output->info.xres = (info->xres + output->scale - 1) / output->scale;
+    output->info.yres = (info->yres + output->scale - 1) / output->scale;
+    setupImageFormat(&output->format, &output->info, output->type);
+    // full resolution outputs use the regular row kernels when they fit the framebuffer
+    output->processRows = (output->scale == 1 && (output->type == P4) == is_mono) ?
+                              output->format.processRows : processScaledRows;
+}
+
+void* processOutputBands(void *arg){
+    // every band of framebuffer rows is converted into all outputs while it is still cached
+    ThreadData *data = (ThreadData *)arg;
+    const uint32_t end = data->start_row + data->num_rows;
+
+    for (uint32_t band = data->start_row; band < end; band += data->band_rows) {
+        for (uint32_t i = 0; i < data->num_outputs; ++i) {
+            Output *output = &data->outputs[i];
+            ThreadData band_data = *data;
+            band_data.start_row = band;
+            band_data.num_rows = (end - band < data->band_rows) ? end - band : data->band_rows;
+            band_data.buffer = output->buffer;
+            band_data.row_step = output->format.row_step;
+            band_data.bit_count = output->format.bit_count;
+            band_data.processRowCallback = output->format.processRowCallback;
+            band_data.output = output;
+            output->processRows(&band_data);
+        }
+    }
+    return NULL;
+}
+
+static inline uint32_t gcd32(uint32_t a, uint32_t b) {
+    while (b) {
+        const uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static inline void dumpOutputs(const uint8_t *video_memory, const vsi *info, const cmap *colormap, uint32_t line_length,
+                               Output *outputs, uint32_t num_outputs, uint32_t num_threads) {
+    // bands are a multiple of every scale factor, so scaled rows never straddle two threads
+    uint32_t band_rows = 1;
+    for (uint32_t i = 0; i < num_outputs; ++i) {
+        band_rows = band_rows / gcd32(band_rows, outputs[i].scale) * outputs[i].scale;
+    }
+    while (band_rows < OUTPUT_BAND_ROWS) {
+        band_rows *= 2;
+    }
+
+    for (uint32_t i = 0; i < num_outputs; ++i) {
+        Output *output = &outputs[i];
+        output->map = isOutputFile(output->fp) ? mapOutputFile(output->fp, &output->format) : NULL;
+        if (output->map) {
+            output->buffer = output->map + output->format.header_size;
+        } else {
+            if (isPipe(output->fp)) {
+                preparePipe(fileno(output->fp), &output->format);
+            }
+            output->buffer = allocFrameBuffer(&output->format);
+        }
+    }
+
+    ThreadData data = {
+        .video_memory = video_memory,
+        .info = info,
+        .colormap = colormap,
+        .line_length = line_length,
+        .bytes_per_pixel = (info->bits_per_pixel + 7) / 8,
+        .outputs = outputs,
+        .num_outputs = num_outputs,
+        .band_rows = band_rows
+    };
+    runRows(&data, processOutputBands, 0, info->yres, num_threads, band_rows);
+
+    for (uint32_t i = 0; i < num_outputs; ++i) {
+        Output *output = &outputs[i];
+        const size_t frame_size = output->format.header_size + output->format.image_size;
+        if (output->map) {
+            munmap(output->map, frame_size);
+        } else if (isOutputFile(output->fp)) {
+            // output file that can't be mapped, mapOutputFile already wrote the header
+            writeFully(fileno(output->fp), output->buffer, output->format.image_size, output->format.header_size);
+            freeFrameBuffer(output->buffer, &output->format);
+        } else {
+            writeFrame(output->fp, output->buffer - output->format.header_size, frame_size);
+            freeFrameBuffer(output->buffer, &output->format);
+        }
+    }
+}
+
+static inline void readVideoMemory(int fd_device, uint8_t *video_memory, size_t buffer_size, off_t offset) {
+    // used when the framebuffer can not be memory-mapped
+    if (lseek(fd_device, offset, SEEK_SET) == (off_t)-1){
+        posixError("lseek failed");
+    }
+    ssize_t read_bytes = read(fd_device, video_memory, buffer_size);
+    if (read_bytes < 0){
+        posixError("read failed");
+    } else if ((size_t)read_bytes != buffer_size) {
+        errno = EIO;
+        posixError("read failed");
+    }
+}
+
+// virtual device
+/// Pixel layouts of the virtual device
+typedef struct VirtualFormat {
+    const char *name;
+    uint32_t bits_per_pixel;
+    uint32_t visual;
+    struct fb_bitfield red, green, blue, transp;
+} VirtualFormat;
+static const VirtualFormat virtual_formats[] = {
+    {"XRGB8888", 32, FB_VISUAL_TRUECOLOR, {16, 8, 0}, {8, 8, 0}, {0, 8, 0}, {0, 0, 0}},
+    {"ARGB8888", 32, FB_VISUAL_TRUECOLOR, {16, 8, 0}, {8, 8, 0}, {0, 8, 0}, {24, 8, 0}},
+    {"XBGR8888", 32, FB_VISUAL_TRUECOLOR, {0, 8, 0}, {8, 8, 0}, {16, 8, 0}, {0, 0, 0}},
+    {"ABGR8888", 32, FB_VISUAL_TRUECOLOR, {0, 8, 0}, {8, 8, 0}, {16, 8, 0}, {24, 8, 0}},
+    {"RGB888", 24, FB_VISUAL_TRUECOLOR, {16, 8, 0}, {8, 8, 0}, {0, 8, 0}, {0, 0, 0}},
+    {"BGR888", 24, FB_VISUAL_TRUECOLOR, {0, 8, 0}, {8, 8, 0}, {16, 8, 0}, {0, 0, 0}},
+    {"RGB565", 16, FB_VISUAL_TRUECOLOR, {11, 5, 0}, {5, 6, 0}, {0, 5, 0}, {0, 0, 0}},
+    {"BGR565", 16, FB_VISUAL_TRUECOLOR, {0, 5, 0}, {5, 6, 0}, {11, 5, 0}, {0, 0, 0}},
+    {"XRGB1555", 16, FB_VISUAL_TRUECOLOR, {10, 5, 0}, {5, 5, 0}, {0, 5, 0}, {0, 0, 0}},
+    {"C8", 8, FB_VISUAL_PSEUDOCOLOR, {0, 8, 0}, {0, 8, 0}, {0, 8, 0}, {0, 0, 0}},
+    {"MONO01", 1, FB_VISUAL_MONO01, {0, 1, 0}, {0, 1, 0}, {0, 1, 0}, {0, 0, 0}},
+    {"MONO10", 1, FB_VISUAL_MONO10, {0, 1, 0}, {0, 1, 0}, {0, 1, 0}, {0, 0, 0}}
+};
+static inline uint32_t packVirtualPixel(uint8_t red, uint8_t green, uint8_t blue, const vsi *var) {
+    // keeps the high bits of every channel, alpha is opaque
+    return ((uint32_t)(red >> (8 - var->red.length)) << var->red.offset) |
+           ((uint32_t)(green >> (8 - var->green.length)) << var->green.offset) |
+           ((uint32_t)(blue >> (8 - var->blue.length)) << var->blue.offset) |
+           (((1U << var->transp.length) - 1) << var->transp.offset);
+}
+static inline void fillVirtualDevice(uint8_t *memory, const VirtualDevice *virt) {
+    // Synthetic test image: red and green gradients, blue x^y pattern, 1 bpp bars and checkers.
+    // Padding and the area outside of the visible part are 0xA5 so that a wrong offset shows.
+    const vsi *var = &virt->var;
+    const uint32_t width = var->xres, height = var->yres;
+    const uint32_t bytes_per_pixel = (var->bits_per_pixel + 7) / 8;
+
+    memset(memory, 0xA5, virt->fix.smem_len);
+    for (uint32_t y = 0; y < height; ++y) {
+        uint8_t *line = memory + (y + var->yoffset) * virt->fix.line_length;
+        if (var->bits_per_pixel == 1) {
+            memset(line + var->xoffset / 8, 0, (width + 7) / 8);
+        }
+        for (uint32_t x = 0; x < width; ++x) {
+            const uint8_t red = width > 1 ? x * 255 / (width - 1) : 0;
+            const uint8_t green = height > 1 ? y * 255 / (height - 1) : 0;
+            const uint8_t blue = (x ^ y) & 0xFF;
+            if (var->bits_per_pixel == 1) {
+                // lowest bit is the leftmost pixel
+                const uint32_t bit = var->xoffset + x;
+                line[bit / 8] |= (((x * 4 / width) ^ (y / 16)) & 1) << (bit % 8);
+                continue;
+            }
+            const uint32_t pixel = (virt->fix.visual == FB_VISUAL_PSEUDOCOLOR) ?
+                                       (red & 0xE0) | ((green & 0xE0) >> 3) | (blue >> 6) :
+                                       packVirtualPixel(red, green, blue, var);
+            uint8_t *current = line + (var->xoffset + x) * bytes_per_pixel;
+            for (uint32_t i = 0; i < bytes_per_pixel; ++i) {
+                current[i] = pixel >> (i * 8);
+            }
+        }
+    }
+}
+static inline int openVirtualDevice(const char *spec, VirtualDevice *virt) {
+    // WxH[:FORMAT][:stride=N][:xoffset=N][:yoffset=N][:visual=direct][:file]
+    // The contents live in a memfd, mmap and read work on it like on a real device.
+    const VirtualFormat *format = &virtual_formats[0];
+    const char *file_name = NULL;
+    uint32_t width, height, stride = 0, xoffset = 0, yoffset = 0;
+    bool direct = false;
+    char *end;
+
+    width = strtoul(spec, &end, 10);
+    if (end == spec || *end != 'x') {
+        notSupported("virtual device needs a size like virt:640x480");
+    }
+    spec = end + 1;
+    height = strtoul(spec, &end, 10);
+    if (end == spec || width == 0 || height == 0 || (*end && *end != ':')) {
+        notSupported("virtual device needs a size like virt:640x480");
+    }
+    for (spec = end; *spec == ':' && !file_name;) {
+        const char *field = spec + 1;
+        const char *next = strchr(field, ':');
+        const size_t length = next ? (size_t)(next - field) : strlen(field);
+        bool known = false;
+        for (size_t i = 0; i < sizeof(virtual_formats) / sizeof(virtual_formats[0]); ++i) {
+            if (strlen(virtual_formats[i].name) == length && strncasecmp(field, virtual_formats[i].name, length) == 0) {
+                format = &virtual_formats[i];
+                known = true;
+            }
+        }
+        if (!known && (sscanf(field, "stride=%" SCNu32, &stride) == 1 || sscanf(field, "xoffset=%" SCNu32, &xoffset) == 1 ||
+                       sscanf(field, "yoffset=%" SCNu32, &yoffset) == 1)) {
+            known = true;
+        }
+        if (!known && strncmp(field, "visual=direct", length) == 0 && length == strlen("visual=direct")) {
+            direct = true;
+            known = true;
+        }
+        if (!known) {
+            file_name = field; // the rest, it may contain ':'
+        }
+        spec = field + length;
+    }
+
+    memset(virt, 0, sizeof(*virt));
+    virt->enabled = true;
+    vsi *var = &virt->var;
+    var->xres = width;
+    var->yres = height;
+    var->xoffset = xoffset;
+    var->yoffset = yoffset;
+    var->xres_virtual = width + xoffset;
+    var->yres_virtual = height + yoffset;
+    var->bits_per_pixel = format->bits_per_pixel;
+    var->grayscale = 0;
+    var->red = format->red;
+    var->green = format->green;
+    var->blue = format->blue;
+    var->transp = format->transp;
+
+    struct fb_fix_screeninfo *fix = &virt->fix;
+    snprintf(fix->id, sizeof(fix->id), "virt %s", format->name);
+    fix->type = FB_TYPE_PACKED_PIXELS;
+    fix->visual = (direct && format->visual == FB_VISUAL_TRUECOLOR) ? FB_VISUAL_DIRECTCOLOR : format->visual;
+    fix->line_length = (var->xres_virtual * var->bits_per_pixel + 7) / 8;
+    if (stride) {
+        if (stride < fix->line_length) {
+            notSupported("virtual device stride is smaller than a line");
+        }
+        fix->line_length = stride;
+    }
+    fix->smem_len = fix->line_length * var->yres_virtual;
+
+    // PSEUDOCOLOR: 3-3-2 palette, DIRECTCOLOR: inverted ramps so that a missing lookup shows
+    for (uint32_t i = 0; i < 256; ++i) {
+        if (fix->visual == FB_VISUAL_PSEUDOCOLOR) {
+            virt->colormap[0][i] = (i >> 5) * 0xFFFF / 7;
+            virt->colormap[1][i] = ((i >> 2) & 7) * 0xFFFF / 7;
+            virt->colormap[2][i] = (i & 3) * 0xFFFF / 3;
+        } else {
+            virt->colormap[0][i] = 0xFFFF - (i & ((1 << var->red.length) - 1)) * 0xFFFF / ((1 << var->red.length) - 1);
+            virt->colormap[1][i] = 0xFFFF - (i & ((1 << var->green.length) - 1)) * 0xFFFF / ((1 << var->green.length) - 1);
+            virt->colormap[2][i] = 0xFFFF - (i & ((1 << var->blue.length) - 1)) * 0xFFFF / ((1 << var->blue.length) - 1);
+        }
+    }
+
+    const int fd_device = memfd_create("fbo-virt", 0);
+    if (fd_device == -1 || ftruncate(fd_device, fix->smem_len)) {
+        posixError("could not create the virtual device");
+    }
+    uint8_t *memory = (uint8_t *)mmap(NULL, fix->smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd_device, 0);
+    if (memory == MAP_FAILED) {
+        posixError("mmap failed");
+    }
+    if (file_name) {
+        // raw framebuffer memory, ex: cat /dev/fb0 > file
+        const int fd_file = open(file_name, O_RDONLY);
+        if (fd_file == -1) {
+            posixError("could not open %s", file_name);
+        }
+        for (size_t done = 0; done < fix->smem_len;) {
+            const ssize_t result = read(fd_file, memory + done, fix->smem_len - done);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result < 0) {
+                posixError("read failed");
+            }
+            if (result == 0) {
+                notSupported("virtual device file is smaller than line_length x yres_virtual");
+            }
+            done += result;
+        }
+        close(fd_file);
+    } else {
+        fillVirtualDevice(memory, virt);
+    }
+    munmap(memory, fix->smem_len);
+    return fd_device;
+}
+static inline int deviceIoctl(int fd_device, const VirtualDevice *virt, unsigned long request, void *arg) {
+    // the virtual device answers the fbdev requests main() makes
+    if (!virt->enabled) {
+        return ioctl(fd_device, request, arg);
+    }
+    switch (request) {
+    case FBIOGET_FSCREENINFO:
+        memcpy(arg, &virt->fix, sizeof(virt->fix));
+        return 0;
+    case FBIOGET_VSCREENINFO:
+        memcpy(arg, &virt->var, sizeof(virt->var));
+        return 0;
+    case FBIOGETCMAP: {
+        cmap *colormap = (cmap *)arg;
+        if (colormap->start + colormap->len > 256) {
+            errno = EINVAL;
+            return -1;
+        }
+        for (uint32_t i = 0; i < colormap->len; ++i) {
+            colormap->red[i] = virt->colormap[0][colormap->start + i];
+            colormap->green[i] = virt->colormap[1][colormap->start + i];
+            colormap->blue[i] = virt->colormap[2][colormap->start + i];
+            if (colormap->transp)
+                colormap->transp[i] = 0;
+        }
+        return 0;
+    }
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+// snapshots
+static inline uint32_t setupSnapshot(const vsi *info, vsi *raw_info) {
+    // a snapshot holds the visible area only, returns its line length
+    *raw_info = *info;
+    raw_info->xoffset = 0;
+    raw_info->yoffset = 0;
+    return (info->xres * info->bits_per_pixel + 7) / 8;
+}
+static inline void snapshotVideoMemory(const uint8_t *video_memory, const vsi *info, uint32_t line_length, uint8_t *snapshot) {
+    // copies only the visible part of the framebuffer, rows packed without padding
+    const uint32_t raw_line_length = (info->xres * info->bits_per_pixel + 7) / 8;
+    const uint8_t *current = video_memory + info->yoffset * line_length +
+                             info->xoffset * info->bits_per_pixel / 8;
+    for (uint32_t y = 0; y < info->yres; ++y) {
+        memcpy(snapshot, current, raw_line_length);
+        current += line_length;
+        snapshot += raw_line_length;
+    }
+}
+
+// pipeline
+static inline void idleWait(void) {
+    // lock-free queues are polled, give the core away while waiting
+    const struct timespec wait = { 0, 100000L };
+    nanosleep(&wait, NULL);
+}
+static inline void initFrameQueue(FrameQueue *queue, uint32_t capacity) {
+    queue->slots = (_Atomic(Frame *) *)calloc(capacity, sizeof(*queue->slots));
+    if (queue->slots == NULL) {
+        posixError("malloc failed");
+    }
+    queue->capacity = capacity;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->drops, 0);
+    atomic_init(&queue->max_depth, 0);
+}
+static inline uint32_t frameQueueDepth(FrameQueue *queue) {
+    // head first: head never passes tail, so a tail loaded later is never behind it,
+    // also from a thread that is neither the producer nor the consumer
+    const uint64_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    return atomic_load_explicit(&queue->tail, memory_order_acquire) - head;
+}
+static inline Frame *pushFrame(FrameQueue *queue, Frame *frame, DropPolicy policy) {
+    // Single producer. Returns the frame the caller gets back for reuse: NULL when the frame was
+    // queued, the frame itself when it was dropped (newest), or the dropped oldest frame.
+    const uint64_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    Frame *dropped = NULL;
+
+    for (;;) {
+        uint64_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail - head < queue->capacity)
+            break;
+        if (policy == DROP_NEWEST) {
+            atomic_fetch_add_explicit(&queue->drops, 1, memory_order_relaxed);
+            return frame;
+        }
+        if (policy == DROP_OLDEST) {
+            // the consumer moves head too, whoever wins the exchange owns the oldest frame
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &head, head + 1,
+                                                      memory_order_acq_rel, memory_order_acquire)) {
+                dropped = atomic_load_explicit(&queue->slots[head % queue->capacity], memory_order_relaxed);
+                atomic_fetch_add_explicit(&queue->drops, 1, memory_order_relaxed);
+                break;
+            }
+            continue;
+        }
+        idleWait();
+    }
+
+    atomic_store_explicit(&queue->slots[tail % queue->capacity], frame, memory_order_relaxed);
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+    const uint32_t depth = frameQueueDepth(queue);
+    if (depth > atomic_load_explicit(&queue->max_depth, memory_order_relaxed)) {
+        atomic_store_explicit(&queue->max_depth, depth, memory_order_relaxed);
+    }
+    return dropped;
+}
+static inline Frame *popFrame(FrameQueue *queue) {
+    // Single consumer, returns NULL if the queue is empty
+    uint64_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    for (;;) {
+        if (head == atomic_load_explicit(&queue->tail, memory_order_acquire))
+            return NULL;
+        Frame *frame = atomic_load_explicit(&queue->slots[head % queue->capacity], memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&queue->head, &head, head + 1,
+                                                  memory_order_acq_rel, memory_order_acquire))
+            return frame;
+    }
+}
+static inline Frame *takeFrame(FrameQueue *pool) {
+    // pools are sized so that a free frame always comes back soon
+    Frame *frame;
+    while ((frame = popFrame(pool)) == NULL) {
+        idleWait();
+    }
+    return frame;
+}
+
+void* convertStage(void *arg) {
+    Pipeline *pipeline = (Pipeline *)arg;
+    const ImageFormat *format = &pipeline->format;
+
+    ThreadData data = {
+        .info = &pipeline->raw_info,
+        .colormap = pipeline->colormap,
+        .line_length = pipeline->raw_line_length,
+        .bytes_per_pixel = (pipeline->raw_info.bits_per_pixel + 7) / 8,
+        .row_step = format->row_step,
+        .bit_count = format->bit_count,
+        .processRowCallback = format->processRowCallback
+    };
+    Frame *out = takeFrame(&pipeline->out_pool);
+
+    for (;;) {
+        Frame *raw = popFrame(&pipeline->raw_queue);
+        if (raw == NULL) {
+            if (atomic_load_explicit(&pipeline->capture_done, memory_order_acquire) &&
+                frameQueueDepth(&pipeline->raw_queue) == 0)
+                break;
+            idleWait();
+            continue;
+        }
+
+        data.video_memory = raw->data;
+        data.buffer = out->data;
+        runRows(&data, format->processRows, 0, pipeline->raw_info.yres, pipeline->num_threads, 1);
+        out->number = raw->number;
+        out->timestamp = raw->timestamp;
+        pushFrame(&pipeline->raw_pool, raw, DROP_BLOCK);
+
+        Frame *reuse = pushFrame(&pipeline->out_queue, out, pipeline->policy);
+        out = reuse ? reuse : takeFrame(&pipeline->out_pool);
+    }
+
+    atomic_store_explicit(&pipeline->convert_done, true, memory_order_release);
+    return NULL;
+}
+
+void* outputStage(void *arg) {
+    Pipeline *pipeline = (Pipeline *)arg;
+    const ImageFormat *format = &pipeline->format;
+    const size_t frame_size = format->header_size + format->image_size;
+    const bool in_place = isOutputFile(pipeline->fp);
+    // spliced pages stay in the pipe for a while, frames go back to the pool this many frames later
+    Frame **delay = (Frame **)calloc(pipeline->splice_delay + 1, sizeof(Frame *));
+    uint32_t delayed = 0;
+    if (delay == NULL) {
+        posixError("malloc failed");
+    }
+    if (in_place) {
+        fflush(pipeline->fp);
+        if (ftruncate(fileno(pipeline->fp), frame_size)) {
+            posixError("ftruncate failed");
+        }
+    }
+
+    for (;;) {
+        Frame *frame = popFrame(&pipeline->out_queue);
+        if (frame == NULL) {
+            if (atomic_load_explicit(&pipeline->convert_done, memory_order_acquire) &&
+                frameQueueDepth(&pipeline->out_queue) == 0)
+                break;
+            idleWait();
+            continue;
+        }
+
+        if (in_place) {
+            // the file always holds the newest frame
+            writeFully(fileno(pipeline->fp), frame->data - format->header_size, frame_size, 0);
+        } else {
+            writeFrame(pipeline->fp, frame->data - format->header_size, frame_size);
+        }
+
+        const double latency = nowMs() - frame->timestamp;
+        ++pipeline->written;
+        pipeline->latency_sum += latency;
+        if (latency > pipeline->latency_max)
+            pipeline->latency_max = latency;
+        if (pipeline->stats) {
+            fprintf(pipeline->stats, "{\"frame\":%" PRIu64 ",\"latency_ms\":%.3f,\"raw_depth\":%" PRIu32 ",\"raw_drops\":%" PRIu64
+                    ",\"out_depth\":%" PRIu32 ",\"out_drops\":%" PRIu64 "}\n",
+                    frame->number, latency,
+                    frameQueueDepth(&pipeline->raw_queue), atomic_load(&pipeline->raw_queue.drops),
+                    frameQueueDepth(&pipeline->out_queue), atomic_load(&pipeline->out_queue.drops));
+            fflush(pipeline->stats);
+        }
+
+        delay[delayed++] = frame;
+        if (delayed > pipeline->splice_delay) {
+            pushFrame(&pipeline->out_pool, delay[0], DROP_BLOCK);
+            memmove(delay, delay + 1, pipeline->splice_delay * sizeof(Frame *));
+            --delayed;
+        }
+    }
+
+    free(delay);
+    return NULL;
+}
+
+
+static inline void runPipeline(Pipeline *pipeline, uint8_t *video_memory, uint64_t repeat_count, uint32_t wait_ms) {
+    // snapshot (this thread) -> raw queue -> convert stage -> output queue -> output stage
+    const vsi *info = pipeline->info;
+    const uint32_t depth = pipeline->depth;
+    pthread_t convert_thread, output_thread;
+
+    setupImageFormat(&pipeline->format, info, pipeline->imageFileFormat);
+    pipeline->raw_line_length = setupSnapshot(info, &pipeline->raw_info);
+    pipeline->splice_delay = isPipe(pipeline->fp) ? preparePipe(fileno(pipeline->fp), &pipeline->format) - 1 : 0;
+    atomic_init(&pipeline->capture_done, false);
+    atomic_init(&pipeline->convert_done, false);
+
+    // preallocated frames: the queue plus one in the hands of every stage
+    const uint32_t raw_frames = depth + 2;
+    const uint32_t out_frames = depth + 2 + pipeline->splice_delay;
+    initFrameQueue(&pipeline->raw_queue, depth);
+    initFrameQueue(&pipeline->out_queue, depth);
+    initFrameQueue(&pipeline->raw_pool, raw_frames);
+    initFrameQueue(&pipeline->out_pool, out_frames);
+    Frame *frames = (Frame *)calloc(raw_frames + out_frames, sizeof(Frame));
+    if (frames == NULL) {
+        posixError("malloc failed");
+    }
+    for (uint32_t i = 0; i < raw_frames; ++i) {
+        if ((frames[i].data = (uint8_t *)malloc(pipeline->raw_line_length * info->yres)) == NULL) {
+            posixError("malloc failed");
+        }
+        pushFrame(&pipeline->raw_pool, &frames[i], DROP_BLOCK);
+    }
+    for (uint32_t i = raw_frames; i < raw_frames + out_frames; ++i) {
+        frames[i].data = allocFrameBuffer(&pipeline->format);
+        pushFrame(&pipeline->out_pool, &frames[i], DROP_BLOCK);
+    }
+
+    if (pthread_create(&convert_thread, NULL, convertStage, pipeline) ||
+        pthread_create(&output_thread, NULL, outputStage, pipeline)) {
+        posixError("pthread_create failed");
+    }
+
+    Frame *raw = takeFrame(&pipeline->raw_pool);
+    for (uint64_t number = 0; repeat_count == 0 || number < repeat_count; ++number) {
+        if (number && wait_ms) {
+            const struct timespec wait = { wait_ms / 1000, (wait_ms % 1000) * 1000000L };
+            nanosleep(&wait, NULL);
+        }
+        if (!pipeline->mmapped) {
+            readVideoMemory(pipeline->fd_device, video_memory, pipeline->buffer_size, pipeline->visible_offset);
+        }
+        raw->timestamp = nowMs();
+        raw->number = number;
+        snapshotVideoMemory(video_memory, info, pipeline->line_length, raw->data);
+        ++pipeline->captured;
+
+        Frame *reuse = pushFrame(&pipeline->raw_queue, raw, pipeline->policy);
+        raw = reuse ? reuse : takeFrame(&pipeline->raw_pool);
+    }
+    atomic_store_explicit(&pipeline->capture_done, true, memory_order_release);
+
+    pthread_join(convert_thread, NULL);
+    pthread_join(output_thread, NULL);
+
+    fprintf(stderr, "fbo: pipeline: captured %" PRIu64 ", written %" PRIu64
+            ", raw queue max depth %" PRIu32 " drops %" PRIu64
+            ", output queue max depth %" PRIu32 " drops %" PRIu64
+            ", latency avg %.3f ms max %.3f ms\n",
+            pipeline->captured, pipeline->written,
+            atomic_load(&pipeline->raw_queue.max_depth), atomic_load(&pipeline->raw_queue.drops),
+            atomic_load(&pipeline->out_queue.max_depth), atomic_load(&pipeline->out_queue.drops),
+            pipeline->written ? pipeline->latency_sum / pipeline->written : 0.0, pipeline->latency_max);
+}
+
+// background capture
+static inline bool parseCpuList(const char *arg, cpu_set_t *cpus) {
+    // 0 or 1-3 or 0,2-3
+    CPU_ZERO(cpus);
+    while (*arg) {
+        char *end;
+        const unsigned long first = strtoul(arg, &end, 10);
+        unsigned long last = first;
+        if (end == arg)
+            return false;
+        if (*end == '-') {
+            arg = end + 1;
+            last = strtoul(arg, &end, 10);
+            if (end == arg || last < first)
+                return false;
+        }
+        if (last >= CPU_SETSIZE)
+            return false;
+        for (unsigned long cpu = first; cpu <= last; ++cpu)
+            CPU_SET(cpu, cpus);
+        if (*end == ',')
+            ++end;
+        else if (*end)
+            return false;
+        arg = end;
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+static inline void setupBackground(int policy, const cpu_set_t *cpus) {
+    // called before any thread starts, every thread inherits the policy and the affinity
+    const struct sched_param param = { .sched_priority = 0 };
+    if (policy != SCHED_OTHER && sched_setscheduler(0, policy, &param)) {
+        posixError("sched_setscheduler failed");
+    }
+    if (cpus && sched_setaffinity(0, sizeof(cpu_set_t), cpus)) {
+        posixError("sched_setaffinity failed");
+    }
+}
+
+// burst
+static inline bool parseBurst(const char *arg, Burst *burst) {
+    // N[,huge][,lock]
+    char *end;
+    burst->count = strtoul(arg, &end, 10);
+    if (burst->count == 0)
+        return false;
+    while (*end == ',') {
+        ++end;
+        const size_t length = strcspn(end, ",");
+        if (length == 4 && strncmp(end, "huge", 4) == 0) {
+            burst->huge = true;
+        } else if (length == 4 && strncmp(end, "lock", 4) == 0) {
+            burst->lock = true;
+        } else {
+            return false;
+        }
+        end += length;
+    }
+    return *end == '\0';
+}
+
+static inline bool isFramePattern(const char *name) {
+    // exactly one %d, %0Nd or %Nd conversion, %% is allowed
+    uint32_t conversions = 0;
+    for (const char *c = name; *c; ++c) {
+        if (*c != '%')
+            continue;
+        if (c[1] == '%') {
+            ++c;
+            continue;
+        }
+        ++c;
+        while (*c >= '0' && *c <= '9')
+            ++c;
+        if (*c != 'd')
+            return false;
+        ++conversions;
+    }
+    return conversions == 1;
+}
+
+static inline uint8_t *allocArena(Burst *burst, size_t size) {
+    // hugepages first, then normal pages with a transparent hugepage hint. Populated up front
+    // so that no page fault lands between two snapshots.
+    uint8_t *arena = MAP_FAILED;
+    if (burst->huge) {
+        const size_t huge_size = (size + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+        arena = (uint8_t *)mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (arena != MAP_FAILED) {
+            burst->arena_size = huge_size;
+        } else {
+            fprintf(stderr, "fbo: no hugepages, using normal pages: %s\n", strerror(errno));
+        }
+    }
+    if (arena == MAP_FAILED) {
+        arena = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (arena == MAP_FAILED) {
+            posixError("mmap failed");
+        }
+        burst->arena_size = size;
+        if (burst->huge) {
+            (void)madvise(arena, size, MADV_HUGEPAGE);
+        }
+    }
+    if (burst->lock && mlock(arena, burst->arena_size)) {
+        fprintf(stderr, "fbo: mlock failed, the arena may be paged out: %s\n", strerror(errno));
+    }
+    return arena;
+}
+
+void* writeBurstFrames(void *arg){
+    // rows are frame numbers here, every frame goes to its own file
+    ThreadData *data = (ThreadData *)arg;
+    const Burst *burst = data->burst;
+
+    for (uint32_t i = data->start_row; i < data->start_row + data->num_rows; ++i) {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), burst->pattern, (int)i);
+        const int fd = open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd == -1) {
+            posixError("could not open %s", name);
+        }
+        FILE *fp = fdopen(fd, "wb");
+        if (fp == NULL) {
+            posixError("could not open %s", name);
+        }
+        dumpVideoMemory(burst->arena + i * burst->frame_size, &burst->raw_info, data->colormap,
+                        burst->raw_line_length, fp, 1, burst->imageFileFormat, NULL);
+        if (fclose(fp)) {
+            posixError("write error");
+        }
+    }
+    return NULL;
+}
+
+static inline void runBurst(Burst *burst, uint8_t *video_memory, const vsi *info, const cmap *colormap,
+                            uint32_t line_length, FILE *fp, uint32_t num_threads, uint32_t wait_ms) {
+    // capture everything first, encoding and I/O wait until the burst is over
+    burst->raw_line_length = setupSnapshot(info, &burst->raw_info);
+    burst->frame_size = ((size_t)burst->raw_line_length * info->yres + 63) & ~(size_t)63; // cache line aligned frames
+    burst->arena = allocArena(burst, burst->frame_size * burst->count);
+    burst->timestamps = (double *)malloc(burst->count * sizeof(double));
+    if (burst->timestamps == NULL) {
+        posixError("malloc failed");
+    }
+
+    for (uint32_t i = 0; i < burst->count; ++i) {
+        if (i && wait_ms) {
+            const struct timespec wait = { wait_ms / 1000, (wait_ms % 1000) * 1000000L };
+            nanosleep(&wait, NULL);
+        }
+        if (!burst->mmapped) {
+            readVideoMemory(burst->fd_device, video_memory, burst->buffer_size, burst->visible_offset);
+        }
+        burst->timestamps[i] = nowMs();
+        snapshotVideoMemory(video_memory, info, line_length, burst->arena + i * burst->frame_size);
+    }
+
+    double min_interval = 0, max_interval = 0;
+    for (uint32_t i = 1; i < burst->count; ++i) {
+        const double interval = burst->timestamps[i] - burst->timestamps[i - 1];
+        if (i == 1 || interval < min_interval)
+            min_interval = interval;
+        if (interval > max_interval)
+            max_interval = interval;
+    }
+    const double duration = burst->timestamps[burst->count - 1] - burst->timestamps[0];
+    fprintf(stderr, "fbo: burst: %" PRIu32 " frames in %.3f ms, interval avg %.3f ms min %.3f ms max %.3f ms\n",
+            burst->count, duration, burst->count > 1 ? duration / (burst->count - 1) : 0.0, min_interval, max_interval);
+    if (burst->stats) {
+        for (uint32_t i = 0; i < burst->count; ++i) {
+            fprintf(burst->stats, "{\"frame\":%" PRIu32 ",\"timestamp_ms\":%.3f,\"interval_ms\":%.3f}\n", i,
+                    burst->timestamps[i] - burst->timestamps[0], i ? burst->timestamps[i] - burst->timestamps[i - 1] : 0.0);
+        }
+        fflush(burst->stats);
+    }
+
+    if (burst->pattern) {
+        // one file per frame, frames are converted in parallel
+        ThreadData data = {
+            .colormap = colormap,
+            .burst = burst
+        };
+        runRows(&data, writeBurstFrames, 0, burst->count, num_threads, 1);
+    } else {
+        // one stream, frames one after the other, rows in parallel
+        for (uint32_t i = 0; i < burst->count; ++i) {
+            if (FORMAT_GIF && burst->imageFileFormat == GIF) {
+                // one animation with the captured timing
+                dumpGif(burst->arena + i * burst->frame_size, &burst->raw_info, colormap, burst->raw_line_length,
+                        fp, num_threads, &burst->gif, burst->timestamps[i]);
+                continue;
+            }
+            dumpVideoMemory(burst->arena + i * burst->frame_size, &burst->raw_info, colormap, burst->raw_line_length,
+                            fp, num_threads, burst->imageFileFormat, NULL);
+            struct stat output_stat;
+            if (fstat(fileno(fp), &output_stat) == 0 && S_ISREG(output_stat.st_mode)) {
+                // the first frame was written in place at offset 0, the next ones go behind it
+                fseek(fp, 0, SEEK_END);
+            }
+        }
+    }
+
+    finishGif(&burst->gif, fp);
+
+    if (burst->lock) {
+        munlock(burst->arena, burst->arena_size);
+    }
+    munmap(burst->arena, burst->arena_size);
+    free(burst->timestamps);
+}
+
+// tuning
+static inline void profileKey(char *key, size_t size, const struct fb_fix_screeninfo *fix, const vsi *info, FileType type) {
+    // device id, resolution and format, tab separated
+    static const char *const type_names[] = {"P4", "P5", "P6", "BMP", "BMPG", "BMPC", "BMPP", "GIF"};
+    char id[sizeof(fix->id) + 1];
+    const size_t length = strnlen(fix->id, sizeof(fix->id));
+    for (size_t i = 0; i < length; ++i) {
+        id[i] = (fix->id[i] < ' ' || fix->id[i] > '~') ? '_' : fix->id[i];
+    }
+    id[length] = '\0';
+    snprintf(key, size, "%s\t%" PRIu32 "x%" PRIu32 "x%" PRIu32 "\t%s", length ? id : "-",
+             info->xres, info->yres, info->bits_per_pixel, type_names[type]);
+}
+static inline const char *profilePath(char *path, size_t size) {
+    // FBO_PROFILES, otherwise ~/.fbo_profiles
+    const char *env = getenv("FBO_PROFILES");
+    if (env && env[0]) {
+        return env;
+    }
+    env = getenv("HOME");
+    snprintf(path, size, "%s/.fbo_profiles", env && env[0] ? env : "/tmp");
+    return path;
+}
+static inline bool loadProfile(const char *path, const char *key, Profile *profile) {
+    // one line per key: key<TAB>threads band_rows staging ms
+    FILE *fp = fopen(path, "r");
+    char line[256];
+    bool found = false;
+    if (fp == NULL) {
+        return false;
+    }
+    const size_t key_length = strlen(key);
+    while (fgets(line, sizeof(line), fp)) {
+        uint32_t staging;
+        if (strncmp(line, key, key_length) == 0 && line[key_length] == '\t' &&
+            sscanf(line + key_length + 1, "%" SCNu32 " %" SCNu32 " %" SCNu32 " %lf", &profile->threads,
+                   &profile->band_rows, &staging, &profile->ms) == 4 && profile->threads) {
+            profile->staging = staging;
+            found = true;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+static inline void saveProfile(const char *path, const char *key, const Profile *profile) {
+    // rewrites the file without the old line of the key, rename keeps it whole for concurrent readers
+    char temp_path[PATH_MAX + 16], line[256];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int)getpid());
+    FILE *out = fopen(temp_path, "w");
+    if (out == NULL) {
+        posixError("could not open %s", temp_path);
+    }
+    FILE *in = fopen(path, "r");
+    const size_t key_length = strlen(key);
+    while (in && fgets(line, sizeof(line), in)) {
+        if (!(strncmp(line, key, key_length) == 0 && line[key_length] == '\t'))
+            fputs(line, out);
+    }
+    if (in) {
+        fclose(in);
+    }
+    fprintf(out, "%s\t%" PRIu32 " %" PRIu32 " %d %.3f\n", key, profile->threads, profile->band_rows,
+            profile->staging, profile->ms);
+    if (fclose(out) || rename(temp_path, path)) {
+        posixError("could not write %s", path);
+    }
+}
+static inline double measureProfile(const Profile *profile, uint8_t *video_memory, const vsi *info, const cmap *colormap,
+                                    uint32_t line_length, const Pipeline *source, FileType imageFileFormat, FILE *fp) {
+    // median time of a few frames after a warm up one
+    enum { TUNE_FRAMES = 5 };
+    double times[TUNE_FRAMES];
+    vsi raw_info;
+    const uint32_t raw_line_length = setupSnapshot(info, &raw_info);
+    uint8_t *stage = profile->staging ? (uint8_t *)malloc(raw_line_length * info->yres) : NULL;
+    if (profile->staging && stage == NULL) {
+        posixError("malloc failed");
+    }
+
+    work_band_rows = profile->band_rows;
+    for (int32_t frame = -1; frame < TUNE_FRAMES; ++frame) {
+        const double started = nowMs();
+        if (!source->mmapped) {
+            readVideoMemory(source->fd_device, video_memory, source->buffer_size, source->visible_offset);
+        }
+        if (stage) {
+            snapshotVideoMemory(video_memory, info, line_length, stage);
+            dumpVideoMemory(stage, &raw_info, colormap, raw_line_length, fp, profile->threads, imageFileFormat, NULL);
+        } else {
+            dumpVideoMemory(video_memory, info, colormap, line_length, fp, profile->threads, imageFileFormat, NULL);
+        }
+        if (frame >= 0) {
+            times[frame] = nowMs() - started;
+        }
+    }
+    work_band_rows = 0;
+    free(stage);
+
+    for (uint32_t i = 1; i < TUNE_FRAMES; ++i) {
+        for (uint32_t j = i; j > 0 && times[j - 1] > times[j]; --j) {
+            const double swap = times[j];
+            times[j] = times[j - 1];
+            times[j - 1] = swap;
+        }
+    }
+    return times[TUNE_FRAMES / 2];
+}
+static inline Profile tuneCapture(uint8_t *video_memory, const vsi *info, const cmap *colormap, uint32_t line_length,
+                                  const Pipeline *source, FileType imageFileFormat, uint32_t max_threads) {
+    // Tries thread counts, band heights and staging copy vs direct reads of the mapping.
+    // Output goes to /dev/null, only the capture and conversion are timed.
+    static const uint32_t bands[] = {0, 8, 32, 128};
+    Profile best = { .threads = 1, .ms = -1 };
+    FILE *fp = fopen("/dev/null", "w");
+    if (fp == NULL) {
+        posixError("could not open /dev/null");
+    }
+
+    for (uint32_t threads = 1; threads <= max_threads; threads = (threads * 2 > max_threads && threads < max_threads) ? max_threads : threads * 2) {
+        for (size_t band = 0; band < sizeof(bands) / sizeof(bands[0]); ++band) {
+            if (threads == 1 && bands[band])
+                break; // a single thread has nothing to balance
+            for (int staging = 0; staging <= (source->mmapped ? 1 : 0); ++staging) {
+                Profile profile = { .threads = threads, .band_rows = bands[band], .staging = staging };
+                profile.ms = measureProfile(&profile, video_memory, info, colormap, line_length, source, imageFileFormat, fp);
+                fprintf(stderr, "fbo: tune: threads %" PRIu32 ", band %" PRIu32 " rows, %s: %.3f ms\n", profile.threads,
+                        profile.band_rows, profile.staging ? "staging copy" : "direct reads", profile.ms);
+                if (best.ms < 0 || profile.ms < best.ms)
+                    best = profile;
+            }
+        }
+    }
+    fclose(fp);
+    return best;
+}
+
+int main(int argc, char **argv){
     // init
     char *fbdev_name = DefaultFbDev;
-    int fd_device, fd_ouput_file;
+    int fd_device, fd_ouput_file = -1;
     FILE *ouput_file = DefaultOutputFile;
     bool mmapped_memory = false, is_mono = false;
     fsi fix_info;
@@ -690,15 +3304,29 @@ int main(int argc, char **argv){
     int result_opt;
     int option_index = 0;
     int flag_help = 0, flag_version = 0, flag_info = 0, flag_device = 0, flag_output = 0,
-        flag_gray = 0, flag_colored = 0, flag_bitmap = 0,
-        flag_thread = 0,
-        flag_err = 0;
-    char *output_file_name;
+        flag_gray = 0, flag_colored = 0, flag_bitmap = 0, flag_gif = 0, flag_palette = 0,
+        flag_thread = 0, flag_repeat = 0, flag_all = 0, flag_stats = 0, flag_probe = 0, flag_queue = 0, flag_burst = 0,
+        flag_nice = 0, flag_affinity = 0, flag_tune = 0, flag_err = 0;
+    char *output_file_name = NULL;
+    char *stats_file_name = NULL;
+    uint64_t repeat_count = 1;
+    uint32_t wait_ms = 0;
+    int sched_policy = SCHED_IDLE;
+    cpu_set_t cpus;
+    uint64_t frames_done = 0;
+    double latency_sum = 0, latency_max = 0, cpu_sum = 0;
+    FrameHistory history = {0};
+    VirtualDevice virt = {0};
+    Probe probe = { .lock = PTHREAD_MUTEX_INITIALIZER, .regions_x = 4, .regions_y = 4 };
+    Pipeline pipeline = { .depth = 4, .policy = DROP_BLOCK };
+    Burst burst = {0};
+    Output outputs[MAX_OUTPUTS] = {0};
+    uint32_t num_outputs = 0;
     //char *imageFileFormat = "BMPC";
     FileType imageFileFormat;
 
     // Kısa ve Uzun seçenekleri tanımlama
-    static const char* short_options = "hvid:o:gcbt";
+    static const char* short_options = "hvid:o:gcbtr:w:as::p::Hq:D:B:GP:xn::u:A:T";
     static const struct option long_options[] = {
         {"help", no_argument, 0, 'h'},
         {"version", no_argument, 0, 'v'},
@@ -708,7 +3336,23 @@ int main(int argc, char **argv){
         {"gray", no_argument, 0, 'g'},
         {"colored", no_argument, 0, 'c'},
         {"bitmap", no_argument, 0, 'b'},
+        {"gif", no_argument, 0, 'G'},
+        {"palette", required_argument, 0, 'P'},
+        {"dither", no_argument, 0, 'x'},
         {"thread", no_argument, 0, 't'},
+        {"repeat", required_argument, 0, 'r'},
+        {"wait", required_argument, 0, 'w'},
+        {"all", no_argument, 0, 'a'},
+        {"stats", optional_argument, 0, 's'},
+        {"probe", optional_argument, 0, 'p'},
+        {"phash", no_argument, 0, 'H'},
+        {"queue", required_argument, 0, 'q'},
+        {"drop", required_argument, 0, 'D'},
+        {"burst", required_argument, 0, 'B'},
+        {"nice", optional_argument, 0, 'n'},
+        {"budget", required_argument, 0, 'u'},
+        {"affinity", required_argument, 0, 'A'},
+        {"tune", no_argument, 0, 'T'},
         {0, 0, 0, 0}
     };
 
@@ -730,7 +3374,12 @@ int main(int argc, char **argv){
             break;
         case 'o':
             flag_output = 1;
-            output_file_name = optarg;
+            if (num_outputs == MAX_OUTPUTS || !parseOutput(optarg, &outputs[num_outputs])) {
+                fprintf(stderr, "option -o or --output is file[:scale=1/N][:format=ppm], at most %d times!...\n", MAX_OUTPUTS);
+                flag_err = 1;
+                break;
+            }
+            output_file_name = outputs[num_outputs++].file_name;
             break;
         case 'g':
             flag_gray = 1;
@@ -741,15 +3390,117 @@ int main(int argc, char **argv){
         case 'b':
             flag_bitmap = 1;
             break;
+        case 'G':
+            flag_gif = 1;
+            break;
+        case 'P':
+            flag_palette = 1;
+            if (strcmp(optarg, "332") == 0) {
+                palette = PALETTE_332;
+            } else if (strcmp(optarg, "web") == 0) {
+                palette = PALETTE_WEB;
+            } else {
+                fprintf(stderr, "option -P or --palette is 332 or web!...\n");
+                flag_err = 1;
+            }
+            break;
+        case 'x':
+            dither = true;
+            break;
         case 't':
             flag_thread = 1;
             break;
+        case 'r':
+            flag_repeat = 1;
+            repeat_count = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            wait_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            flag_all = 1;
+            break;
+        case 's':
+            flag_stats = 1;
+            stats_file_name = optarg;
+            break;
+        case 'p':
+            flag_probe = 1;
+            if (optarg && (sscanf(optarg, "%" SCNu32 "x%" SCNu32, &probe.regions_x, &probe.regions_y) != 2 ||
+                           probe.regions_x == 0 || probe.regions_y == 0)) {
+                fprintf(stderr, "option -p or --probe needs a region grid like 4x4!...\n");
+                flag_err = 1;
+            }
+            break;
+        case 'H':
+            probe.phash = true;
+            break;
+        case 'q':
+            flag_queue = 1;
+            pipeline.depth = strtoul(optarg, NULL, 10);
+            if (pipeline.depth == 0) {
+                fprintf(stderr, "option -q or --queue needs a depth > 0!...\n");
+                flag_err = 1;
+            }
+            break;
+        case 'B':
+            flag_burst = 1;
+            if (!parseBurst(optarg, &burst)) {
+                fprintf(stderr, "option -B or --burst is N[,huge][,lock]!...\n");
+                flag_err = 1;
+            }
+            break;
+        case 'n':
+            flag_nice = 1;
+            if (optarg && strcmp(optarg, "batch") == 0) {
+                sched_policy = SCHED_BATCH;
+            } else if (optarg && strcmp(optarg, "idle") != 0) {
+                fprintf(stderr, "option -n or --nice is idle or batch!...\n");
+                flag_err = 1;
+            }
+            break;
+        case 'u':
+            if (sscanf(optarg, "%" SCNu32, &cpu_budget) != 1 || cpu_budget == 0 || cpu_budget > 100) {
+                fprintf(stderr, "option -u or --budget is a percent between 1 and 100!...\n");
+                flag_err = 1;
+            }
+            break;
+        case 'A':
+            flag_affinity = 1;
+            if (!parseCpuList(optarg, &cpus)) {
+                fprintf(stderr, "option -A or --affinity is a cpu list like 0,2-3!...\n");
+                flag_err = 1;
+            }
+            break;
+        case 'T':
+            flag_tune = 1;
+            break;
+        case 'D':
+            if (strcmp(optarg, "block") == 0) {
+                pipeline.policy = DROP_BLOCK;
+            } else if (strcmp(optarg, "oldest") == 0) {
+                pipeline.policy = DROP_OLDEST;
+            } else if (strcmp(optarg, "newest") == 0) {
+                pipeline.policy = DROP_NEWEST;
+            } else {
+                fprintf(stderr, "option -D or --drop is block, oldest or newest!...\n");
+                flag_err = 1;
+            }
+            break;
         case '?':
             // error part
             if (optopt == 'd'){
                 fprintf(stderr, "option -d or --device without argument!. Device " DefaultFbDev "\n");
             } else if (optopt == 'o'){
                 fprintf(stderr, "option -o or --output without argument!...\n");
+            } else if (optopt == 'r' || optopt == 'w' || optopt == 'q' || optopt == 'B' || optopt == 'u'){
+                fprintf(stderr, "option -%c needs a number!...\n", optopt);
+            } else if (optopt == 'D'){
+                fprintf(stderr, "option -D or --drop without argument! block, oldest or newest\n");
+            } else if (optopt == 'P'){
+                fprintf(stderr, "option -P or --palette without argument!...\n");
+            } else if (optopt == 'A'){
+                fprintf(stderr, "option -A or --affinity without argument!...\n");
             } else if (optopt != 0) {
                 fprintf(stderr, "invalid option: -%c\n", optopt);
             } else {
@@ -780,15 +3531,27 @@ int main(int argc, char **argv){
             fbdev_name = DefaultFbDev;
         fprintf(stderr,"Framebuffer device: %s\n", fbdev_name);
     }
-    if ((fd_device = open(fbdev_name, O_RDONLY)) == -1){
+    if (strncmp(fbdev_name, "virt:", 5) == 0){
+        fd_device = openVirtualDevice(fbdev_name + 5, &virt);
+    } else if ((fd_device = open(fbdev_name, O_RDONLY)) == -1){
         posixError("could not open %s", fbdev_name);
     }
     if (flag_output) {
-        fprintf(stderr,"Output file: %s\n", output_file_name);
-        if ((fd_ouput_file = open(output_file_name, O_WRONLY|O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1)
-            posixError("could not open %s", output_file_name);
-        if((ouput_file = fdopen(fd_ouput_file, "wb"))==NULL)
-            posixError("could not open %s", output_file_name);
+        for (uint32_t i = 0; i < num_outputs; ++i) {
+            output_file_name = outputs[i].file_name;
+            fprintf(stderr,"Output file: %s\n", output_file_name);
+            if (flag_burst && isFramePattern(output_file_name))
+                continue; // opened per frame
+            if ((fd_ouput_file = open(output_file_name, O_RDWR|O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1)
+                posixError("could not open %s", output_file_name);
+            if((outputs[i].fp = fdopen(fd_ouput_file, "wb"))==NULL)
+                posixError("could not open %s", output_file_name);
+        }
+        if (outputs[0].fp) {
+            ouput_file = outputs[0].fp;
+            fd_ouput_file = fileno(ouput_file);
+        }
+        output_file_name = outputs[0].file_name;
     }
 
     // Color mode checks. Default: Colored
@@ -807,9 +3570,39 @@ int main(int argc, char **argv){
     if(flag_bitmap){
         fprintf(stderr,"Bitmap file mode mode is selected\n");
     }
+    if(flag_gif){
+        fprintf(stderr,"Gif file mode is selected\n");
+    }
     if(flag_thread){
         fprintf(stderr,"Thread run mode mode is selected\n");
     }
+    if(flag_repeat){
+        fprintf(stderr,"Repeat mode is selected\n");
+        history.write_unchanged = flag_all;
+    }
+    if(flag_probe){
+        fprintf(stderr,"Probe mode is selected\n");
+    }
+    if(flag_queue && !flag_probe){
+        fprintf(stderr,"Pipeline mode is selected\n");
+    }
+    if(flag_burst && !flag_probe){
+        fprintf(stderr,"Burst mode is selected\n");
+    }
+    if(cpu_budget){
+        fprintf(stderr,"Background capture within %" PRIu32 "%% of a core is selected\n", cpu_budget);
+        if (!flag_nice)
+            sched_policy = SCHED_BATCH;
+        flag_nice = 1;
+    }
+    if(flag_nice){
+        fprintf(stderr,"Background scheduling (%s) is selected\n", sched_policy == SCHED_IDLE ? "SCHED_IDLE" : "SCHED_BATCH");
+    }
+    if(flag_stats){
+        history.stats = stderr;
+        if (stats_file_name && (history.stats = fopen(stats_file_name, "w")) == NULL)
+            posixError("could not open %s", stats_file_name);
+    }
 
     // The remains threated as mistake.
     if (optind < argc) {
@@ -820,14 +3613,14 @@ int main(int argc, char **argv){
         exit(EXIT_FAILURE);
     }
     /// other checks
-    if (ioctl(fd_device, FBIOGET_FSCREENINFO, &fix_info)){
+    if (deviceIoctl(fd_device, &virt, FBIOGET_FSCREENINFO, &fix_info)){
         posixError("FBIOGET_FSCREENINFO failed");
     }
     if (fix_info.type != FB_TYPE_PACKED_PIXELS){
         notSupported("framebuffer type is not PACKED_PIXELS");
     }
 
-    if (ioctl(fd_device, FBIOGET_VSCREENINFO, &var_info)){
+    if (deviceIoctl(fd_device, &virt, FBIOGET_VSCREENINFO, &var_info)){
         posixError("FBIOGET_VSCREENINFO failed");
     }
     if (var_info.red.length > 8 || var_info.green.length > 8 ||
@@ -858,7 +3651,7 @@ int main(int argc, char **argv){
     case FB_VISUAL_DIRECTCOLOR:
     case FB_VISUAL_PSEUDOCOLOR:
     case FB_VISUAL_STATIC_PSEUDOCOLOR:
-        if (ioctl(fd_device, FBIOGETCMAP, &colormap) != 0){
+        if (deviceIoctl(fd_device, &virt, FBIOGETCMAP, &colormap) != 0){
             posixError("FBIOGETCMAP failed");
         }
         break;
@@ -879,60 +3672,200 @@ int main(int argc, char **argv){
     if (var_info.bits_per_pixel != 1 && is_mono){
         notSupported("monochrome framebuffer is not 1 bpp");
     }
+    checkBuildFormat(&var_info);
 
     // process
     /// try memory-map else use malloc
     const size_t mapped_length = fix_info.line_length * (var_info.yres + var_info.yoffset);
+    const off_t visible_offset = fix_info.line_length * var_info.yoffset;
+    const size_t buffer_size = fix_info.line_length * var_info.yres;
     uint8_t *video_memory = (uint8_t *)mmap(NULL, mapped_length, PROT_READ, MAP_SHARED, fd_device, 0);
     if (video_memory != MAP_FAILED){
         mmapped_memory = true;
     } else {
         mmapped_memory = false;
-        const size_t buffer_size = fix_info.line_length * var_info.yres;
         video_memory = (uint8_t *)malloc(buffer_size);
         if (video_memory == NULL){
             posixError("malloc failed");
         }
-        off_t offset = lseek(fd_device, fix_info.line_length * var_info.yoffset, SEEK_SET);
-        if (offset == (off_t)-1){
-            posixError("lseek failed");
-        }
         var_info.yoffset = 0;
-        ssize_t read_bytes = read(fd_device, video_memory, buffer_size);
-        if (read_bytes < 0){
-            posixError("read failed");
-        } else if ((size_t)read_bytes != buffer_size) {
-            errno = EIO;
-            posixError("read failed");
-        }
     }
 
     fflush(ouput_file);
-    if(flag_bitmap){
+    if(flag_gif){
+        imageFileFormat = GIF;
+    } else if(flag_bitmap){
         // imageFileFormat = flag_colored ? "BMPC" : "BMPG";
-        imageFileFormat = flag_colored ? BMPC : BMPG;
+        imageFileFormat = flag_palette ? BMPP : flag_colored ? BMPC : BMPG;
     } else{
         imageFileFormat = is_mono ? P4 :
                           flag_colored ? P6 : P5;
     }
-    if (isatty(STDOUT_FILENO)) {
+    // a single unscaled output keeps the color and bitmap options whatever its name is
+    const bool extension_wins = num_outputs > 1 || (num_outputs == 1 && outputs[0].scale > 1);
+    for (uint32_t i = 0; i < num_outputs; ++i) {
+        if (!formatEnabled(outputs[i].has_type || (outputs[i].extension_type && extension_wins) ? outputs[i].type : imageFileFormat)) {
+            notSupported("file format is not in FBO_FORMATS of this build");
+        }
+    }
+    if (!formatEnabled(imageFileFormat) && !flag_probe) {
+        notSupported("file format is not in FBO_FORMATS of this build");
+    }
+    if ((imageFileFormat == GIF || imageFileFormat == BMPP) && is_mono) {
+        notSupported("palette output of a monochrome framebuffer");
+    }
+    if (!flag_probe && isatty(STDOUT_FILENO)) {
         fprintf(stderr, "fbo: refusing to write binary data to a terminal\n");
         flag_err = 1;
     }
-    dumpVideoMemory(video_memory, &var_info, &colormap, fix_info.line_length, ouput_file, flag_thread,
-                    imageFileFormat);
+    // sysconf returns -1 when the count is unknown
+    const long cpus_online = sysconf(_SC_NPROCESSORS_ONLN);
+    const uint32_t max_threads = flag_affinity ? (uint32_t)CPU_COUNT(&cpus) : (cpus_online < 1) ? 1 : (uint32_t)cpus_online;
+    uint32_t num_threads = flag_thread ? max_threads : 1;
+    setupBackground(flag_nice ? sched_policy : SCHED_OTHER, flag_affinity ? &cpus : NULL);
+
+    const bool multi_output = !flag_probe && (num_outputs > 1 || (num_outputs == 1 && (outputs[0].scale > 1 || outputs[0].has_type)));
+    if (flag_tune && (flag_probe || flag_queue || flag_burst || multi_output)) {
+        // measureProfile times the single output conversion of imageFileFormat only
+        fprintf(stderr, "option -T or --tune can't be mixed with -p, -q, -B or several/converted outputs!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // tuned profile of this device, resolution and format
+    char profile_key[128], profile_path[PATH_MAX];
+    Profile profile;
+    profileKey(profile_key, sizeof(profile_key), &fix_info, &var_info, imageFileFormat);
+    const char *profiles = profilePath(profile_path, sizeof(profile_path));
+    if (flag_tune) {
+        const Pipeline source = { .mmapped = mmapped_memory, .fd_device = fd_device, .buffer_size = buffer_size,
+                                  .visible_offset = visible_offset };
+        profile = tuneCapture(video_memory, &var_info, &colormap, fix_info.line_length, &source, imageFileFormat,
+                              max_threads);
+        saveProfile(profiles, profile_key, &profile);
+        fprintf(stderr, "fbo: tune: best threads %" PRIu32 ", band %" PRIu32 " rows, %s: %.3f ms, saved to %s\n",
+                profile.threads, profile.band_rows, profile.staging ? "staging copy" : "direct reads", profile.ms, profiles);
+        exit(EXIT_SUCCESS);
+    }
+    bool staging = false;
+    if (loadProfile(profiles, profile_key, &profile)) {
+        // an explicit -t, -A or --budget keeps its own thread count, the budget is split by it
+        if (!flag_thread && !flag_affinity && !cpu_budget) {
+            profile.threads = (profile.threads < max_threads) ? profile.threads : max_threads;
+            num_threads = profile.threads;
+        }
+        work_band_rows = profile.band_rows;
+        staging = profile.staging && mmapped_memory;
+        fprintf(stderr, "Tuned profile is loaded: threads %" PRIu32 ", band %" PRIu32 " rows, %s\n",
+                num_threads, profile.band_rows, profile.staging ? "staging copy" : "direct reads");
+    }
+    const bool bursting = flag_burst && !flag_probe;
+    const bool pipelined = flag_queue && !flag_probe && !multi_output && !bursting && imageFileFormat != GIF;
+    if (bursting) {
+        burst.mmapped = mmapped_memory;
+        burst.fd_device = fd_device;
+        burst.buffer_size = buffer_size;
+        burst.visible_offset = visible_offset;
+        burst.imageFileFormat = imageFileFormat;
+        burst.pattern = (flag_output && isFramePattern(output_file_name)) ? output_file_name : NULL;
+        burst.stats = history.stats;
+        runBurst(&burst, video_memory, &var_info, &colormap, fix_info.line_length, ouput_file,
+                 num_threads > 0 ? num_threads : 1, wait_ms);
+    }
+    for (uint32_t i = 0; multi_output && i < num_outputs; ++i) {
+        if (!outputs[i].has_type && !(outputs[i].extension_type && extension_wins))
+            outputs[i].type = imageFileFormat;
+        setupOutput(&outputs[i], &var_info);
+    }
+    if (pipelined) {
+        pipeline.info = &var_info;
+        pipeline.colormap = &colormap;
+        pipeline.line_length = fix_info.line_length;
+        pipeline.mmapped = mmapped_memory;
+        pipeline.fd_device = fd_device;
+        pipeline.buffer_size = buffer_size;
+        pipeline.visible_offset = visible_offset;
+        pipeline.imageFileFormat = imageFileFormat;
+        pipeline.fp = ouput_file;
+        pipeline.stats = history.stats;
+        pipeline.num_threads = num_threads > 0 ? num_threads : 1;
+        runPipeline(&pipeline, video_memory, repeat_count, wait_ms);
+    }
+    // staging: conversion reads a cached copy of the visible area instead of the mapping
+    vsi stage_info;
+    const uint32_t stage_line_length = setupSnapshot(&var_info, &stage_info);
+    uint8_t *stage = NULL;
+    if (staging && !pipelined && !bursting && (stage = (uint8_t *)malloc(stage_line_length * var_info.yres)) == NULL) {
+        posixError("malloc failed");
+    }
+    const uint8_t *source = stage ? stage : video_memory;
+    const vsi *source_info = stage ? &stage_info : &var_info;
+    const uint32_t source_line_length = stage ? stage_line_length : fix_info.line_length;
+    for (uint64_t frame = 0; !pipelined && !bursting && (repeat_count == 0 || frame < repeat_count); ++frame) {
+        if (frame && wait_ms) {
+            const struct timespec wait = { wait_ms / 1000, (wait_ms % 1000) * 1000000L };
+            nanosleep(&wait, NULL);
+        }
+        const double started = nowMs();
+        const double cpu_started = cpuMs(CLOCK_PROCESS_CPUTIME_ID);
+        if (!mmapped_memory) {
+            readVideoMemory(fd_device, video_memory, buffer_size, visible_offset);
+        }
+        if (stage) {
+            snapshotVideoMemory(video_memory, &var_info, fix_info.line_length, stage);
+        }
+        if (multi_output) {
+            dumpOutputs(source, source_info, &colormap, source_line_length, outputs, num_outputs,
+                        num_threads > 0 ? num_threads : 1);
+        } else if (flag_probe) {
+            probeVideoMemory(source, source_info, &colormap, source_line_length, ouput_file,
+                             num_threads > 0 ? num_threads : 1, &probe);
+        } else {
+            dumpVideoMemory(source, source_info, &colormap, source_line_length, ouput_file,
+                            num_threads > 0 ? num_threads : 1, imageFileFormat, flag_repeat ? &history : NULL);
+        }
+        // capture latency against the CPU time it took, for tuning the budget
+        const double latency = nowMs() - started;
+        ++frames_done;
+        latency_sum += latency;
+        latency_max = latency > latency_max ? latency : latency_max;
+        cpu_sum += cpuMs(CLOCK_PROCESS_CPUTIME_ID) - cpu_started;
+    }
+    if ((flag_nice || virt.enabled) && frames_done) {
+        // also the timing of a conversion path on the virtual device
+        fprintf(stderr, "fbo: %s: %" PRIu64 " frames, capture latency avg %.3f ms max %.3f ms"
+                ", cpu avg %.3f ms per frame (%.1f%% of a core while capturing)\n",
+                flag_nice ? "background" : "virtual device", frames_done, latency_sum / frames_done, latency_max, cpu_sum / frames_done,
+                latency_sum > 0 ? cpu_sum * 100.0 / latency_sum : 0.0);
+    }
+
+    if (flag_repeat && !pipelined && !bursting) {
+        finishGif(&history.gif, ouput_file);
+    }
 
     // close and free
     if (fclose(stdout)){
         posixError("write error");
     }
 
+    if (history.stats && history.stats != stderr) {
+        fclose(history.stats);
+    }
+    if (history.map) {
+        munmap(history.map, history.map_size);
+    }
+
+    free(stage);
     // deliberately ignore errors
     (void)(mmapped_memory ? munmap(video_memory, mapped_length) : free(video_memory));
 
     close(fd_device);
     close(fd_ouput_file);
     fclose(ouput_file);
+    for (uint32_t i = 1; i < num_outputs; ++i) {
+        if (outputs[i].fp) {
+            fclose(outputs[i].fp);
+        }
+    }
 
     return 0;
 }